@@ -0,0 +1,419 @@
+#ifndef _CHECKPOINT_HPP_
+#define _CHECKPOINT_HPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#if defined(__unix__) || defined(__unix)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "LockFree.hpp"
+
+// World checkpoints.
+// A checkpoint file is a header, a section table and the sections: arrays of fixed size, 8 byte aligned
+// plain records in host byte order. Everything refers to everything else by offset from the start
+// of the file, so it can be mmap()ed and read in place. Strings share one section.
+// Readers skip section types they do not know, so adding one does not need a version bump;
+// changing a record does.
+// Times in records are relative to the checkpoint (negative is in the past), because the clock
+// of the process that restores it has nothing to do with the one that saved it.
+
+enum class CheckpointSectionType : uint32_t
+{
+    entities = 1,
+    items,
+    bullets,
+    strings
+};
+
+enum class CheckpointEntityKind : uint8_t
+{
+    other,
+    player,
+    zombie,
+    crystal
+};
+
+struct CheckpointHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t sectionCount; // CheckpointSections right after the header
+    uint64_t fileSize;
+    uint32_t tick;
+    uint32_t reserved;
+    double time; // Simulation time, seconds since the match started
+};
+
+struct CheckpointSection
+{
+    uint32_t type;
+    uint32_t recordSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct EntityRecord
+{
+    uint32_t id;
+    uint8_t kind;       // CheckpointEntityKind
+    int8_t team;        // Team::id, -1 for none
+    uint16_t flags;     // Player movement flags
+    int32_t health;
+    int32_t healthMax;
+    uint32_t name;      // String offset
+    uint32_t track;     // Zombie targets, entity ids; 0 for none
+    uint32_t attackedBy;
+    int32_t damage;
+    double x;
+    double y;
+    double size;
+    double dirX;        // Player facing
+    double dirY;
+    double speed;
+    double attackCooldown;
+    double lastAttack;  // Relative time
+    int32_t ammo;       // Gun, for whoever carries one
+    uint32_t gunFlags;
+    double gunReady;    // Relative time the gun may fire again; 0 if it may now
+    double reloadDone;  // Relative time its reload finishes; 0 if not reloading
+};
+
+struct ItemRecord
+{
+    double x;
+    double y;
+    double size;
+    uint32_t name;
+    int32_t cost;
+    double despawn;     // Relative time it goes away; negative for never
+};
+
+struct BulletRecord
+{
+    double x;
+    double y;
+};
+
+namespace _ckpt
+{
+    static constexpr uint32_t _magic = 0x4B43345A; // "Z4CK"
+    static constexpr uint32_t _version = 2;
+    static constexpr size_t _align = 8;
+
+    constexpr size_t _aligned(size_t n)
+    {return (n + _align - 1) & ~(_align - 1);}
+
+    // Records are copied as bytes and laid end to end, each keeping the alignment of the next
+    template<typename R>
+    constexpr bool _isRecord(void)
+    {return std::is_trivially_copyable<R>::value && sizeof(R) % _align == 0;}
+    static_assert(_isRecord<CheckpointHeader>() && _isRecord<CheckpointSection>(), "checkpoint layout");
+    static_assert(_isRecord<EntityRecord>() && _isRecord<ItemRecord>() && _isRecord<BulletRecord>(), "checkpoint records");
+}
+
+// Collects the records of one checkpoint on the simulation thread, then lays them out as a file image.
+// Keeps its vectors between checkpoints so a steady state does not allocate.
+class CheckpointBuilder
+{
+private:
+    std::vector<EntityRecord> m_entities;
+    std::vector<ItemRecord> m_items;
+    std::vector<BulletRecord> m_bullets;
+    std::string m_strings;
+    std::unordered_map<const char *, uint32_t> m_stringOffsets; // Names are literals, so the pointer is the key
+
+    template<typename R>
+    static void _section(std::vector<char> &out, size_t &index, CheckpointSectionType type, const R *data, size_t count)
+    {
+        size_t offset = out.size();
+        out.resize(_ckpt::_aligned(offset + count * sizeof(R)));
+        if(count)
+            memcpy(out.data() + offset, data, count * sizeof(R));
+        CheckpointSection &sec = reinterpret_cast<CheckpointSection *>(out.data() + sizeof(CheckpointHeader))[index++];
+        sec.type = static_cast<uint32_t>(type);
+        sec.recordSize = sizeof(R);
+        sec.offset = offset;
+        sec.count = count;
+    }
+public:
+    void clear(void)
+    {
+        m_entities.clear();
+        m_items.clear();
+        m_bullets.clear();
+        m_strings.assign(1, '\0'); // Offset 0 is the empty string
+        m_stringOffsets.clear();
+    }
+    CheckpointBuilder()
+    {clear();}
+
+    uint32_t addString(const char *str)
+    {
+        if(!str || !*str)
+            return 0;
+        auto found = m_stringOffsets.find(str);
+        if(found != m_stringOffsets.end())
+            return found->second;
+        uint32_t offset = static_cast<uint32_t>(m_strings.size());
+        m_strings.append(str, strlen(str) + 1);
+        m_stringOffsets.emplace(str, offset);
+        return offset;
+    }
+    EntityRecord &addEntity(void)
+    {
+        m_entities.emplace_back();
+        memset(&m_entities.back(), 0, sizeof(EntityRecord));
+        return m_entities.back();
+    }
+    ItemRecord &addItem(void)
+    {
+        m_items.emplace_back();
+        memset(&m_items.back(), 0, sizeof(ItemRecord));
+        return m_items.back();
+    }
+    BulletRecord &addBullet(void)
+    {
+        m_bullets.emplace_back();
+        return m_bullets.back();
+    }
+
+    size_t entityCount(void) const
+    {return m_entities.size();}
+
+    void write(std::vector<char> &out, uint32_t tick, double time) const
+    {
+        static constexpr size_t sectionCount = 4;
+        out.assign(sizeof(CheckpointHeader) + sectionCount * sizeof(CheckpointSection), 0);
+        size_t index = 0;
+        _section(out, index, CheckpointSectionType::entities, m_entities.data(), m_entities.size());
+        _section(out, index, CheckpointSectionType::items, m_items.data(), m_items.size());
+        _section(out, index, CheckpointSectionType::bullets, m_bullets.data(), m_bullets.size());
+        _section(out, index, CheckpointSectionType::strings, m_strings.data(), m_strings.size());
+        CheckpointHeader header = {};
+        header.magic = _ckpt::_magic;
+        header.version = _ckpt::_version;
+        header.headerSize = sizeof(CheckpointHeader);
+        header.sectionCount = static_cast<uint32_t>(sectionCount);
+        header.fileSize = out.size();
+        header.tick = tick;
+        header.time = time;
+        memcpy(out.data(), &header, sizeof(header));
+    }
+};
+
+// Read-only view of a checkpoint file. Mapped where mmap() exists, read into memory elsewhere.
+class CheckpointFile
+{
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<char> m_copy;
+
+    bool _validate(void)
+    {
+        if(m_size < sizeof(CheckpointHeader))
+            return false;
+        const CheckpointHeader &hdr = header();
+        if(hdr.magic != _ckpt::_magic || hdr.version != _ckpt::_version || hdr.headerSize < sizeof(CheckpointHeader) ||
+            hdr.headerSize > m_size || hdr.headerSize % _ckpt::_align ||
+            hdr.fileSize != m_size || hdr.sectionCount > (m_size - hdr.headerSize) / sizeof(CheckpointSection))
+            return false;
+        for(uint32_t i = 0; i < hdr.sectionCount; ++i)
+        {
+            const CheckpointSection &sec = _sections()[i];
+            if(sec.offset % _ckpt::_align || sec.offset > m_size || !sec.recordSize ||
+                sec.count > (m_size - sec.offset) / sec.recordSize)
+                return false;
+        }
+        return true;
+    }
+    const CheckpointSection *_sections(void) const
+    {return reinterpret_cast<const CheckpointSection *>(m_data + header().headerSize);}
+    const CheckpointSection *_find(CheckpointSectionType type, size_t recordSize) const
+    {
+        for(uint32_t i = 0; i < header().sectionCount; ++i)
+            if(_sections()[i].type == static_cast<uint32_t>(type) && _sections()[i].recordSize == recordSize)
+                return &_sections()[i];
+        return nullptr;
+    }
+public:
+    CheckpointFile() = default;
+    CheckpointFile(const CheckpointFile &) = delete;
+    ~CheckpointFile()
+    {close();}
+
+    // False if the file is missing, truncated or from another version
+    bool open(const std::string &path)
+    {
+        close();
+#if defined(__unix__) || defined(__unix)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd == -1)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *mem = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mem != MAP_FAILED)
+            {
+                m_data = static_cast<const char *>(mem);
+                m_size = static_cast<size_t>(st.st_size);
+                m_mapped = true;
+            }
+        }
+        ::close(fd);
+#else
+        FILE *file = fopen(path.c_str(), "rb");
+        if(!file)
+            return false;
+        char buf[65536];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+            m_copy.insert(m_copy.end(), buf, buf + n);
+        fclose(file);
+        m_data = m_copy.data();
+        m_size = m_copy.size();
+#endif
+        if(!m_data || !_validate())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+    void close(void)
+    {
+#if defined(__unix__) || defined(__unix)
+        if(m_mapped)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+        m_mapped = false;
+        m_copy.clear();
+    }
+
+    const CheckpointHeader &header(void) const
+    {return *reinterpret_cast<const CheckpointHeader *>(m_data);}
+
+    // Records of one section in place; nullptr and a count of 0 if the file has no such section
+    template<typename R>
+    const R *records(CheckpointSectionType type, size_t &count) const
+    {
+        const CheckpointSection *sec = _find(type, sizeof(R));
+        count = sec ? static_cast<size_t>(sec->count) : 0;
+        return sec ? reinterpret_cast<const R *>(m_data + sec->offset) : nullptr;
+    }
+    const char *string(uint32_t offset) const
+    {
+        size_t count;
+        const char *strings = records<char>(CheckpointSectionType::strings, count);
+        if(!strings || offset >= count || !memchr(strings + offset, '\0', count - offset))
+            return "";
+        return strings + offset;
+    }
+};
+
+// Writes checkpoint images on its own thread, so the tick only pays for building one in memory.
+// Two buffers: the tick fills one while the other is on its way to disk. If both are busy the tick
+// skips that checkpoint rather than wait. Each file is written next to the target and renamed over it,
+// so a crash mid-write leaves the previous checkpoint intact.
+class CheckpointWriter
+{
+private:
+    std::string m_path;
+    std::vector<char> m_buffers[2];
+    std::atomic<bool> m_busy[2];
+    size_t m_next;
+    SpscQueue<size_t, 2> m_queue;
+    std::atomic<bool> m_running;
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_failed;
+    std::thread m_thread;
+
+    bool _write(const std::vector<char> &image)
+    {
+        std::string tmpPath = m_path + ".tmp";
+        FILE *file = fopen(tmpPath.c_str(), "wb");
+        if(!file)
+            return false;
+        bool ok = fwrite(image.data(), 1, image.size(), file) == image.size() && fflush(file) == 0;
+#if defined(__unix__) || defined(__unix)
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = (fclose(file) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+        remove(m_path.c_str()); // rename() does not replace on Windows
+#endif
+        return ok && rename(tmpPath.c_str(), m_path.c_str()) == 0;
+    }
+
+    void _run(void)
+    {
+        size_t index;
+        for(;;)
+        {
+            if(!m_queue.tryPop(index))
+            {
+                if(!m_running.load(std::memory_order_acquire))
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            if(_write(m_buffers[index]))
+                m_written.fetch_add(1, std::memory_order_relaxed);
+            else
+                m_failed.fetch_add(1, std::memory_order_relaxed);
+            m_busy[index].store(false, std::memory_order_release);
+        }
+    }
+public:
+    explicit CheckpointWriter(const std::string &path)
+        : m_path(path), m_next(0), m_running(true), m_written(0), m_failed(0)
+    {
+        m_busy[0].store(false, std::memory_order_relaxed);
+        m_busy[1].store(false, std::memory_order_relaxed);
+        m_thread = std::thread(&CheckpointWriter::_run, this);
+    }
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    // Finishes whatever was submitted
+    ~CheckpointWriter()
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+    }
+
+    const std::string &path(void) const
+    {return m_path;}
+    uint64_t written(void) const
+    {return m_written.load(std::memory_order_relaxed);}
+    uint64_t failed(void) const
+    {return m_failed.load(std::memory_order_relaxed);}
+
+    // Tick thread only. The buffer to fill, or nullptr if the disk is still behind
+    std::vector<char> *acquire(void)
+    {return m_busy[m_next].load(std::memory_order_acquire) ? nullptr : &m_buffers[m_next];}
+    // Hands the buffer from the last acquire() to the writer thread
+    void submit(void)
+    {
+        m_busy[m_next].store(true, std::memory_order_relaxed);
+        m_queue.tryPush(m_next); // Cannot fail: at most two buffers are ever in flight
+        m_next ^= 1;
+    }
+};
+
+#endif // _CHECKPOINT_HPP_
@@ -0,0 +1,101 @@
+#ifndef _FIXED_POINT_HPP_
+#define _FIXED_POINT_HPP_
+
+#include <stdint.h>
+#include <math.h>
+#include "Geo.hpp"
+
+// Signed fixed point number on an int32_t, FracBits of them below the point.
+// Meant as a Geo.hpp scalar: BasicPointVector<Fixed16> is exact and identical on every platform.
+// Sums go through uint32_t and products and quotients through int64_t; overflow wraps like the raw
+// integer would.
+template<int FracBits>
+class FixedPoint
+{
+    static_assert(FracBits > 0 && FracBits < 31, "FixedPoint needs at least one integer and one fraction bit");
+private:
+    int32_t m_raw;
+
+    struct _RawTag{};
+    constexpr FixedPoint(int32_t raw, _RawTag) : m_raw(raw) {}
+public:
+    static constexpr int32_t one = int32_t(1) << FracBits;
+
+    constexpr FixedPoint() : m_raw(0) {}
+    constexpr FixedPoint(double value) // Implicit, so literals work in generic code
+        : m_raw(static_cast<int32_t>(value * one + ((value < 0.0) ? -0.5 : 0.5))) {}
+    constexpr FixedPoint(int value) : m_raw(static_cast<int32_t>(value) * one) {}
+
+    static constexpr FixedPoint fromRaw(int32_t raw)
+    {return FixedPoint(raw, _RawTag());}
+    constexpr int32_t raw(void) const
+    {return m_raw;}
+    explicit constexpr operator double(void) const
+    {return static_cast<double>(m_raw) / one;}
+    explicit constexpr operator float(void) const
+    {return static_cast<float>(m_raw) / one;}
+
+    constexpr friend FixedPoint operator+(FixedPoint a, FixedPoint b)
+    {return fromRaw(static_cast<int32_t>(static_cast<uint32_t>(a.m_raw) + static_cast<uint32_t>(b.m_raw)));}
+    constexpr friend FixedPoint operator-(FixedPoint a, FixedPoint b)
+    {return fromRaw(static_cast<int32_t>(static_cast<uint32_t>(a.m_raw) - static_cast<uint32_t>(b.m_raw)));}
+    constexpr friend FixedPoint operator*(FixedPoint a, FixedPoint b)
+    {return fromRaw(static_cast<int32_t>((static_cast<int64_t>(a.m_raw) * b.m_raw) >> FracBits));}
+    constexpr friend FixedPoint operator/(FixedPoint a, FixedPoint b)
+    {return fromRaw(static_cast<int32_t>((static_cast<int64_t>(a.m_raw) * one) / b.m_raw));}
+    constexpr friend FixedPoint operator-(FixedPoint a)
+    {return fromRaw(static_cast<int32_t>(0u - static_cast<uint32_t>(a.m_raw)));}
+
+    FixedPoint &operator+=(FixedPoint other)
+    {return *this = *this + other;}
+    FixedPoint &operator-=(FixedPoint other)
+    {return *this = *this - other;}
+    FixedPoint &operator*=(FixedPoint other)
+    {return *this = *this * other;}
+    FixedPoint &operator/=(FixedPoint other)
+    {return *this = *this / other;}
+
+    constexpr friend bool operator==(FixedPoint a, FixedPoint b)
+    {return a.m_raw == b.m_raw;}
+    constexpr friend bool operator!=(FixedPoint a, FixedPoint b)
+    {return a.m_raw != b.m_raw;}
+    constexpr friend bool operator<(FixedPoint a, FixedPoint b)
+    {return a.m_raw < b.m_raw;}
+    constexpr friend bool operator>(FixedPoint a, FixedPoint b)
+    {return a.m_raw > b.m_raw;}
+    constexpr friend bool operator<=(FixedPoint a, FixedPoint b)
+    {return a.m_raw <= b.m_raw;}
+    constexpr friend bool operator>=(FixedPoint a, FixedPoint b)
+    {return a.m_raw >= b.m_raw;}
+
+    // Not on a hot path, so done in double
+    friend FixedPoint sqrt(FixedPoint value)
+    {return FixedPoint(::sqrt(static_cast<double>(value)));}
+};
+typedef FixedPoint<16> Fixed16; // +-32768 with 1/65536 steps
+
+namespace _geo
+{
+    // The squares are summed in uint64_t: in the scalar itself a Fixed16 vector overflows past about
+    // 181 units. The raw length is the integer square root of that sum, rounded to nearest, and a
+    // length past the largest FixedPoint saturates.
+    template<int FracBits>
+    struct _Length<FixedPoint<FracBits>>
+    {
+        static FixedPoint<FracBits> of(FixedPoint<FracBits> x, FixedPoint<FracBits> y)
+        {
+            const int64_t rx = x.raw(), ry = y.raw();
+            const uint64_t sum = static_cast<uint64_t>(rx * rx) + static_cast<uint64_t>(ry * ry);
+            uint64_t root = static_cast<uint64_t>(::sqrt(static_cast<double>(sum)));
+            while(root * root > sum) // The double is only close; settle on the exact floor
+                --root;
+            while((root + 1) * (root + 1) <= sum)
+                ++root;
+            if(sum - root * root > root) // Past (root + 0.5)^2
+                ++root;
+            return FixedPoint<FracBits>::fromRaw(static_cast<int32_t>((root > INT32_MAX) ? INT32_MAX : root));
+        }
+    };
+}
+
+#endif // _FIXED_POINT_HPP_
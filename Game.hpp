@@ -1,18 +1,28 @@
 #ifndef _GAME_HPP_
 #define _GAME_HPP_
 //#include "SteadyTimer.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <random>
 #include "TreeAlt.hpp"
+#include "PackedIndex.hpp"
+#include "PositionHistory.hpp"
+#include "TimerWheel.hpp"
+#include "Checkpoint.hpp"
 class Game;
 struct Team
 {
     const char *name; // Name of the team
+    int id; // Sent to clients as "team"
 };
 class Entity;
 typedef std::shared_ptr<Entity> EntityPtr;
 typedef std::weak_ptr<Entity> EntityWeakPtr;
-class Entity : public PositionedObject
+// Always owned by an EntityPtr, so whoever only gets an Entity * can still keep a weak reference
+class Entity : public PositionedObject, public std::enable_shared_from_this<Entity>
 {
 private:
+    uint32_t m_id; // Stable for the lifetime of the entity; clients key their state on it
     Game *m_game;
     const Team *m_team; // Pointer to the team this entity belongs to, if any
     const char *m_name; // Name of the entity
@@ -22,7 +32,9 @@ private:
     bool m_valid;
 public:
     Entity(Game *game, const PointVector &pos, const Team *team, const char *name, int healthMax, double size)
-        : PositionedObject(pos), m_game(game), m_team(team), m_name(name), m_health(healthMax), m_healthMax(healthMax), m_size(size), m_valid(true){}
+        : PositionedObject(pos), m_id(_nextId()), m_game(game), m_team(team), m_name(name), m_health(healthMax), m_healthMax(healthMax), m_size(size), m_valid(true){}
+    uint32_t id(void) const
+    {return m_id;}
     Game *game(void) const
     {return m_game;}
     const Team *team(void) const
@@ -42,7 +54,42 @@ public:
 protected:
     void destroy(void)
     {m_valid = false;}
+private:
+    static std::atomic<uint32_t> &_idCounter(void)
+    {
+        static std::atomic<uint32_t> counter(0);
+        return counter;
+    }
+    static uint32_t _nextId(void)
+    {return ++_idCounter();}
 public:
+    // Checkpoints. Overrides add their own fields after calling these; now is timer() at save/restore time.
+    // The name is written by whoever owns the string table.
+    virtual void saveState(EntityRecord &rec, double /*now*/) const
+    {
+        rec.id = m_id;
+        rec.kind = static_cast<uint8_t>(CheckpointEntityKind::other);
+        rec.team = static_cast<int8_t>(m_team ? m_team->id : -1);
+        rec.health = m_health;
+        rec.healthMax = m_healthMax;
+        rec.x = position()[0];
+        rec.y = position()[1];
+        rec.size = m_size;
+    }
+    // Takes over the saved id, so references between restored entities stay valid
+    virtual void restoreState(const EntityRecord &rec, double /*now*/)
+    {
+        m_id = rec.id;
+        uint32_t counter = _idCounter().load();
+        while(counter < m_id)
+        {
+            if(_idCounter().compare_exchange_weak(counter, m_id))
+                break;
+        }
+        m_healthMax = rec.healthMax;
+        setHealth(rec.health);
+        setPosition(PointVector(rec.x, rec.y));
+    }
     virtual void update(void) = 0; // You update Entity object yourself. (Ex: if hp is 0, set destroy and make the entity invalid)
     virtual void healthEvent(Entity *, int deltaHealth)
     {setHealth(health() + deltaHealth);}
@@ -56,9 +103,12 @@ private:
     const char *m_name;
     double m_size;
     int m_cost;
+    Timer m_despawn;
 public:
     DroppedItem(Game *game, const PointVector &pos, const char *name, double size)
-        : PositionedObject(pos), m_game(game), m_name(name), m_size(size){}
+        : PositionedObject(pos), m_game(game), m_name(name), m_size(size), m_cost(0){}
+    // Takes the item out of the item field once seconds have passed, unless it was picked up first
+    inline void despawnAfter(double seconds);
     
     Game *game(void) const
     {return m_game;}
@@ -68,11 +118,25 @@ public:
     {return m_size;}
     int cost(void) const
     {return m_cost;}
+    void setCost(int cost)
+    {m_cost = cost;}
+    // Seconds until despawnAfter() takes it away; negative if it stays
+    inline double despawnRemaining(void) const;
 
     virtual void interact(Entity* ent) = 0;
     virtual ~DroppedItem(){}
 };
 
+// An item read back from a checkpoint. Everything a client sees of it comes back, but nothing records
+// what it did when picked up, so picking it up does nothing.
+class SavedItem : public DroppedItem
+{
+public:
+    SavedItem(Game *game, const PointVector &pos, const char *name, double size)
+        : DroppedItem(game, pos, name, size){}
+    virtual void interact(Entity *) override{}
+};
+
 class Bullet : public PositionedObject
 {
     Game *m_game;
@@ -87,16 +151,118 @@ typedef std::shared_ptr<Bullet> BulletPtr;
 
 class Game
 {
+private:
+    TimerWheel m_timers; // First, so it outlives the Timers of everything below
     QuadTreeNode m_entityField;
-    QuadTreeNode m_itemField;
+    PackedIndex m_itemField; // Items are dropped and picked up, but never walk around
     std::list<BulletPtr> m_bulletField;
-    Game(const Rect &region, size_t playerCapacity = 1, size_t treeCapacity = 8)
-        : m_entityField(region, treeCapacity), m_itemField(region, treeCapacity), m_bulletField(){}
+    std::mt19937 m_rng; // Per game, so rooms on different threads never share one
+    std::unique_ptr<TreeTuner> m_entityTuner;
+    PositionHistory m_history; // Entity positions over the last second, for lag compensation
+    double m_historyMaxSize = 0.0; // Largest entity seen while recording
+public:
+    Game(const Rect &region, size_t playerCapacity = 1, size_t treeCapacity = 8, double tickSeconds = 1.0 / 30.0)
+        : m_timers(tickSeconds), m_entityField(region, treeCapacity), m_itemField(treeCapacity), m_bulletField(){}
+    // Counted in ticks; advanced by whoever runs the game loop, before the entities update
+    TimerWheel &timers()
+    {return m_timers;}
+    const TimerWheel &timers() const
+    {return m_timers;}
+    void setTreeAutoTune(bool enable)
+    {m_entityTuner.reset(enable ? new TreeTuner() : nullptr);}
+    // Once per tick, after the entities moved
+    void tuneTrees()
+    {
+        if (m_entityTuner)
+            m_entityTuner->tick(m_entityField);
+        m_itemField.maintain();
+    }
     QuadTreeNode &entityField()
     {return m_entityField;}
-    QuadTreeNode &itemField()
+    PackedIndex &itemField()
     {return m_itemField;}
+    const QuadTreeNode &entityField() const
+    {return m_entityField;}
+    const PackedIndex &itemField() const
+    {return m_itemField;}
+    std::list<BulletPtr> &bulletField()
+    {return m_bulletField;}
+    std::mt19937 &rng()
+    {return m_rng;}
+    const PositionHistory &history() const
+    {return m_history;}
+
+    // Once per tick, after everything has moved
+    void recordHistory(uint32_t tick)
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        m_history.beginTick(tick);
+        m_entityField.query(Bounds(PointVector(-inf, -inf), PointVector(inf, inf)), [&](const PositionedObjectPtr &obj){
+            const Entity &ent = static_cast<const Entity &>(*obj);
+            m_history.add(ent.id(), ent.position());
+            if (ent.size() > m_historyMaxSize)
+                m_historyMaxSize = ent.size();
+        });
+        m_history.endTick();
+    }
+
+    // First entity a ray from origin hits, with everyone where they were at the end of tick (clamped
+    // to what the history still has). The entity tree is queried around the ray at today's positions,
+    // grown by how far anything can have moved since; only those candidates are rewound.
+    // The shooter's own team is never hit.
+    EntityPtr rewindRaycast(uint32_t tick, const PointVector &origin, const PointVector &direction, double range,
+        const Entity *shooter, double *distance = nullptr)
+    {
+        bool rewind = !m_history.empty();
+        double margin = 0.0;
+        if (rewind)
+        {
+            tick = std::min(std::max(tick, m_history.oldestTick()), m_history.newestTick());
+            margin = m_history.driftSince(tick) + m_historyMaxSize;
+        }
+        const PointVector dir = direction.normalized();
+        const PointVector end = origin + dir * range;
+        const Bounds area(PointVector(std::min(origin[0], end[0]) - margin, std::min(origin[1], end[1]) - margin),
+            PointVector(std::max(origin[0], end[0]) + margin, std::max(origin[1], end[1]) + margin));
+        const Team *team = shooter ? shooter->team() : nullptr;
+        EntityPtr hit;
+        double best = range;
+        // Without a margin the tree only finds centers on the ray's box; good enough before the first tick
+        m_entityField.query(area, [&](const PositionedObjectPtr &obj){
+            const Entity &ent = static_cast<const Entity &>(*obj);
+            if (&ent == shooter || !ent.valid() || (team && ent.team() == team)) return;
+            PointVector pos = ent.position();
+            if (rewind && !m_history.positionAt(tick, ent.id(), pos)) return; // Not there yet on that tick
+            const PointVector toCenter = pos - origin;
+            const double along = toCenter * dir, radius = ent.size();
+            const double miss = toCenter * toCenter - along * along;
+            if (miss > radius * radius) return;
+            double at = along - std::sqrt(radius * radius - miss);
+            if (at < 0.0)
+            {
+                if (toCenter * toCenter > radius * radius) return; // Behind the muzzle
+                at = 0.0;
+            }
+            if (at <= best)
+            {
+                best = at;
+                hit = std::static_pointer_cast<Entity>(obj);
+            }
+        });
+        if (hit && distance)
+            *distance = best;
+        return hit;
+    }
 };
 typedef std::shared_ptr<DroppedItem> DroppedItemPtr;
+
+inline void DroppedItem::despawnAfter(double seconds)
+{
+    m_game->timers().scheduleIn(m_despawn, seconds, [this]{m_game->itemField().remove(this);});
+}
+inline double DroppedItem::despawnRemaining(void) const
+{
+    return m_despawn.pending() ? m_despawn.remaining() * m_game->timers().tickSeconds() : -1.0;
+}
 //typedef std::unique_ptr<Bullet> BulletPtr;
 #endif // _GAME_HPP_
\ No newline at end of file
@@ -2,66 +2,102 @@
 #define _GEO_HPP_
 
 #include <math.h>
+#include <stddef.h>
+#include <cmath>
+#include <limits>
 
-struct PointVector
+namespace _geo
 {
-    double coord[2];
+    // Value for a division by zero: NaN where the scalar has one, zero otherwise (fixed point)
+    template<typename T>
+    constexpr T _invalid(void)
+    {return std::numeric_limits<T>::has_quiet_NaN ? std::numeric_limits<T>::quiet_NaN() : T();}
+
+    // Length of (x, y). A scalar whose squares do not fit in itself specialises this (see FixedPoint.hpp).
+    template<typename T>
+    struct _Length
+    {
+        static T of(T x, T y)
+        {
+            using std::sqrt; // Anything else is found by ADL
+            return sqrt(x * x + y * y);
+        }
+    };
+}
 
-    constexpr const double &operator[](ptrdiff_t idx) const
+// Scalar is float or double, or any type with the arithmetic operators, comparisons,
+// construction from double and a sqrt() found by ADL or a _geo::_Length of its own (see FixedPoint.hpp).
+template<typename T>
+struct BasicPointVector
+{
+    typedef T Scalar;
+    T coord[2];
+
+    constexpr const T &operator[](ptrdiff_t idx) const
     {return coord[idx];}
 
-    constexpr double &operator[](ptrdiff_t idx)
+    constexpr T &operator[](ptrdiff_t idx)
     {return coord[idx];}
 
-    constexpr PointVector(double _x = 0.0, double _y = 0.0) : coord{_x, _y} {}
+    constexpr BasicPointVector(T _x = T(), T _y = T()) : coord{_x, _y} {}
+
+    constexpr BasicPointVector(const BasicPointVector &other) : coord{other[0], other[1]} {}
 
-    constexpr PointVector(const PointVector &other) : coord{other[0], other[1]} {}
+    // Precision changes are always spelled out
+    template<typename U>
+    explicit constexpr BasicPointVector(const BasicPointVector<U> &other)
+        : coord{static_cast<T>(other[0]), static_cast<T>(other[1])} {}
 
-    constexpr friend PointVector operator+(const PointVector &_this, const PointVector &other)
-    {return PointVector(_this[0] + other[0], _this[1] + other[1]);}
+    constexpr BasicPointVector &operator=(const BasicPointVector &other) = default;
 
-    constexpr friend PointVector operator-(const PointVector &_this, const PointVector &other)
-    {return PointVector(_this[0] - other[0], _this[1] - other[1]);}
+    constexpr friend BasicPointVector operator+(const BasicPointVector &_this, const BasicPointVector &other)
+    {return BasicPointVector(_this[0] + other[0], _this[1] + other[1]);}
 
-    constexpr friend PointVector operator*(const PointVector &_this, double scalar)
-    {return PointVector(_this[0] * scalar, _this[1] * scalar);}
+    constexpr friend BasicPointVector operator-(const BasicPointVector &_this, const BasicPointVector &other)
+    {return BasicPointVector(_this[0] - other[0], _this[1] - other[1]);}
 
-    constexpr friend double operator*(const PointVector &_this, const PointVector &other)
+    constexpr friend BasicPointVector operator*(const BasicPointVector &_this, T scalar)
+    {return BasicPointVector(_this[0] * scalar, _this[1] * scalar);}
+
+    constexpr friend T operator*(const BasicPointVector &_this, const BasicPointVector &other)
     {return _this[0] * other[0] + _this[1] * other[1];}
 
-    constexpr friend PointVector operator/(const PointVector &_this, double scalar)
-    {return (scalar == 0.0) ? PointVector(NAN, NAN) : PointVector(_this[0] / scalar, _this[1] / scalar);}
+    constexpr friend BasicPointVector operator/(const BasicPointVector &_this, T scalar)
+    {
+        return (scalar == T()) ? BasicPointVector(_geo::_invalid<T>(), _geo::_invalid<T>()) :
+            BasicPointVector(_this[0] / scalar, _this[1] / scalar);
+    }
 
-    constexpr friend PointVector operator-(const PointVector &_this)
-    {return PointVector(-(_this[0]), -(_this[1]));}
+    constexpr friend BasicPointVector operator-(const BasicPointVector &_this)
+    {return BasicPointVector(-(_this[0]), -(_this[1]));}
 
-    inline PointVector &operator+=(const PointVector &other)
+    inline BasicPointVector &operator+=(const BasicPointVector &other)
     {
         (*this)[0] += other[0];
         (*this)[1] += other[1];
         return *this;
     }
 
-    inline PointVector &operator-=(const PointVector &other)
+    inline BasicPointVector &operator-=(const BasicPointVector &other)
     {
         (*this)[0] -= other[0];
         (*this)[1] -= other[1];
         return *this;
     }
 
-    inline PointVector &operator*=(double scalar)
+    inline BasicPointVector &operator*=(T scalar)
     {
         (*this)[0] *= scalar;
         (*this)[1] *= scalar;
         return *this;
     }
 
-    inline PointVector &operator/=(double scalar)
+    inline BasicPointVector &operator/=(T scalar)
     {
-        if(scalar == 0.0)
+        if(scalar == T())
         {
-            (*this)[0] = NAN;
-            (*this)[1] = NAN; // Set to zero vector to avoid undefined behavior
+            (*this)[0] = _geo::_invalid<T>();
+            (*this)[1] = _geo::_invalid<T>(); // Set to zero vector to avoid undefined behavior
         }
         else
         {
@@ -71,57 +107,72 @@ struct PointVector
         return *this;
     }
 
-    inline double length() const
-    {return sqrt((*this) * (*this));}
+    inline T length() const
+    {return _geo::_Length<T>::of((*this)[0], (*this)[1]);}
 
-    inline PointVector normalized() const
+    inline BasicPointVector normalized() const
     {return (*this) / length();}
 
-    inline PointVector &normalize()
+    inline BasicPointVector &normalize()
     {return (*this) /= length();}
 };
 
-struct Matrix2x2
+template<typename T>
+struct BasicMatrix2x2
 {
-    PointVector basis[2];
+    typedef T Scalar;
+    BasicPointVector<T> basis[2];
 
-    constexpr const PointVector &operator[](ptrdiff_t idx) const
+    constexpr const BasicPointVector<T> &operator[](ptrdiff_t idx) const
     {return basis[idx];}
 
-    constexpr PointVector &operator[](ptrdiff_t idx)
+    constexpr BasicPointVector<T> &operator[](ptrdiff_t idx)
     {return basis[idx];}
 
-    constexpr Matrix2x2(const PointVector &bx = {1.0, 0.0}, const PointVector &by = {0.0, 1.0}) : basis{bx, by} {}
-    constexpr Matrix2x2(const Matrix2x2 &other) : basis{other[0], other[1]} {}
+    constexpr BasicMatrix2x2(const BasicPointVector<T> &bx = {T(1.0), T(0.0)}, const BasicPointVector<T> &by = {T(0.0), T(1.0)}) : basis{bx, by} {}
+    constexpr BasicMatrix2x2(const BasicMatrix2x2 &other) : basis{other[0], other[1]} {}
+
+    template<typename U>
+    explicit constexpr BasicMatrix2x2(const BasicMatrix2x2<U> &other)
+        : basis{BasicPointVector<T>(other[0]), BasicPointVector<T>(other[1])} {}
+
+    constexpr BasicMatrix2x2 &operator=(const BasicMatrix2x2 &other) = default;
 
-    constexpr friend Matrix2x2 operator*(const Matrix2x2 &_this, const Matrix2x2 &other)
+    constexpr friend BasicMatrix2x2 operator*(const BasicMatrix2x2 &_this, const BasicMatrix2x2 &other)
     {
-        return Matrix2x2(
-            PointVector(
+        return BasicMatrix2x2(
+            BasicPointVector<T>(
                 _this[0][0] * other[0][0] + _this[1][0] * other[0][1],
                 _this[0][1] * other[0][0] + _this[1][1] * other[0][1]
             ),
-            PointVector(
+            BasicPointVector<T>(
                 _this[0][0] * other[1][0] + _this[1][0] * other[1][1],
                 _this[0][1] * other[1][0] + _this[1][1] * other[1][1]
             )
         );
     }
 
-    constexpr friend PointVector operator*(const Matrix2x2 &_this, const PointVector &vec)
+    constexpr friend BasicPointVector<T> operator*(const BasicMatrix2x2 &_this, const BasicPointVector<T> &vec)
     {
-        return PointVector(
+        return BasicPointVector<T>(
             _this[0][0] * vec[0] + _this[1][0] * vec[1],
             _this[0][1] * vec[0] + _this[1][1] * vec[1]
         );
     }
 };
 
-Matrix2x2 rotateMatrix(double angle)
+typedef BasicPointVector<double> PointVector;
+typedef BasicPointVector<float> PointVectorF;
+typedef BasicMatrix2x2<double> Matrix2x2;
+typedef BasicMatrix2x2<float> Matrix2x2F;
+
+// The trigonometry is always done in double, only the result is rounded to T
+template<typename T = double>
+inline BasicMatrix2x2<T> rotateMatrix(double angle)
 {
     double cosAngle = cos(angle);
     double sinAngle = sin(angle);
-    return Matrix2x2({cosAngle, sinAngle}, {-sinAngle, cosAngle});
+    return BasicMatrix2x2<T>({T(cosAngle), T(sinAngle)}, {T(-sinAngle), T(cosAngle)});
 }
 
 class RectLooseness
@@ -170,29 +221,38 @@ public:
 static constexpr RectLooseness completelyLoose({{true, true}, {true, true}});
 static constexpr RectLooseness completelyStrict;
 
-class Rect
+template<typename T>
+class BasicRect
 {
 public:
     typedef RectLooseness Looseness;
+    typedef T Scalar;
+    typedef BasicPointVector<T> Point;
 private:
-    PointVector m_min;
-    PointVector m_max;
+    Point m_min;
+    Point m_max;
     Looseness m_looseness;
 
-    static constexpr double __max1(double a, double b)
+    static constexpr T __max1(T a, T b)
     { return (a < b) ? b : a; }
 
-    static constexpr double __min1(double a, double b)
+    static constexpr T __min1(T a, T b)
     { return (a > b) ? b : a; }
 
 public:
-    constexpr Rect(const PointVector &a, const PointVector &b, const Looseness &looseness = {})
+    constexpr BasicRect(const Point &a, const Point &b, const Looseness &looseness = {})
         : m_min(__min1(a[0], b[0]), __min1(a[1], b[1])), m_max(__max1(a[0], b[0]), __max1(a[1], b[1])), m_looseness(looseness) {}
 
-    constexpr Rect(const Rect &other)
+    constexpr BasicRect(const BasicRect &other)
         : m_min(other.m_min), m_max(other.m_max), m_looseness(other.m_looseness) {}
 
-    constexpr bool contains(const PointVector &pos) const
+    template<typename U>
+    explicit constexpr BasicRect(const BasicRect<U> &other)
+        : BasicRect(Point(other.minPoint()), Point(other.maxPoint()), other.looseness()) {}
+
+    constexpr BasicRect &operator=(const BasicRect &other) = default;
+
+    constexpr bool contains(const Point &pos) const
     {
         return 
             (m_looseness.looseMin(0) || m_min[0] <= pos[0]) &&
@@ -201,7 +261,7 @@ public:
             (m_looseness.looseMax(1) || pos[1] <= m_max[1]);
     }
 
-    constexpr bool intersects(const Rect &other) const
+    constexpr bool intersects(const BasicRect &other) const
     {
         return
             (other.m_looseness.looseMin(0) || m_looseness.looseMax(0) || other.m_min[0] <= m_max[0]) &&
@@ -214,20 +274,89 @@ public:
     constexpr Looseness looseness(void) const
     {return m_looseness;}
 
-    constexpr bool discrete(const Rect &other) const
+    constexpr bool discrete(const BasicRect &other) const
     {return !intersects(other);}
 
-    constexpr PointVector center() const { return (m_min + m_max) * 0.5; }
-    constexpr PointVector size() const { return m_max - m_min; }
-    constexpr PointVector minPoint() const { return m_min; }
-    constexpr PointVector maxPoint() const { return m_max; }
-    constexpr PointVector vertex(const bool(&isMax)[2]) const 
+    constexpr Point center() const { return (m_min + m_max) * T(0.5); }
+    constexpr Point size() const { return m_max - m_min; }
+    constexpr Point minPoint() const { return m_min; }
+    constexpr Point maxPoint() const { return m_max; }
+    constexpr Point vertex(const bool(&isMax)[2]) const 
     {
-        return PointVector{
+        return Point{
             isMax[0] ? m_max[0] : m_min[0],
             isMax[1] ? m_max[1] : m_min[1]
         };
     }
 };
+typedef BasicRect<double> Rect;
+typedef BasicRect<float> RectF;
+
+// The region of a BasicRect with its loose edges stored as +-infinity instead of flags, so
+// contains() and intersects() are four comparisons and no branch. Infinite edges have no center,
+// so the trees keep the Rect for subdividing and do their tests with this.
+// Unlike a loose Rect, nothing contains a NaN position.
+template<typename T>
+class BasicBounds
+{
+    static_assert(std::numeric_limits<T>::has_infinity, "BasicBounds needs a scalar with infinities");
+public:
+    typedef T Scalar;
+    typedef BasicPointVector<T> Point;
+private:
+    Point m_min;
+    Point m_max;
+
+    static constexpr T __inf(void)
+    {return std::numeric_limits<T>::infinity();}
+public:
+    constexpr BasicBounds(const Point &min, const Point &max)
+        : m_min(min), m_max(max) {}
+
+    explicit constexpr BasicBounds(const BasicRect<T> &rect)
+        : m_min(rect.looseness().looseMin(0) ? -__inf() : rect.minPoint()[0], rect.looseness().looseMin(1) ? -__inf() : rect.minPoint()[1]),
+          m_max(rect.looseness().looseMax(0) ? __inf() : rect.maxPoint()[0], rect.looseness().looseMax(1) ? __inf() : rect.maxPoint()[1]) {}
+
+    constexpr BasicBounds(const BasicBounds &other)
+        : m_min(other.m_min), m_max(other.m_max) {}
+
+    constexpr BasicBounds &operator=(const BasicBounds &other) = default;
+
+    // & rather than && on purpose: all four are evaluated, which is cheaper than branching on each
+    constexpr bool contains(const Point &pos) const
+    {return (m_min[0] <= pos[0]) & (pos[0] <= m_max[0]) & (m_min[1] <= pos[1]) & (pos[1] <= m_max[1]);}
+
+    constexpr bool intersects(const BasicBounds &other) const
+    {return (other.m_min[0] <= m_max[0]) & (m_min[0] <= other.m_max[0]) & (other.m_min[1] <= m_max[1]) & (m_min[1] <= other.m_max[1]);}
+
+    constexpr bool discrete(const BasicBounds &other) const
+    {return !intersects(other);}
+
+    constexpr Point minPoint() const { return m_min; }
+    constexpr Point maxPoint() const { return m_max; }
+
+    // Back to flags. An infinite edge takes the opposite edge's coordinate, or zero if both are infinite.
+    BasicRect<T> toRect(void) const
+    {
+        T min[2], max[2];
+        bool looseMin[2], looseMax[2];
+        for(size_t axis = 0; axis < 2; ++axis)
+        {
+            looseMin[axis] = (m_min[axis] == -__inf());
+            looseMax[axis] = (m_max[axis] == __inf());
+            min[axis] = looseMin[axis] ? (looseMax[axis] ? T() : m_max[axis]) : m_min[axis];
+            max[axis] = looseMax[axis] ? min[axis] : m_max[axis];
+        }
+        return BasicRect<T>(Point(min[0], min[1]), Point(max[0], max[1]), RectLooseness({
+            {looseMin[0], looseMax[0]},
+            {looseMin[1], looseMax[1]}}));
+    }
+};
+typedef BasicBounds<double> Bounds;
+typedef BasicBounds<float> BoundsF;
+
+template<typename T>
+constexpr BasicBounds<T> toBounds(const BasicRect<T> &rect)
+{return BasicBounds<T>(rect);}
 
 #endif // _GEO_HPP_
\ No newline at end of file
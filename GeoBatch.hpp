@@ -0,0 +1,124 @@
+#ifndef _GEO_BATCH_HPP_
+#define _GEO_BATCH_HPP_
+
+#include <stddef.h>
+#include "Geo.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _GEO_BATCH_SSE2
+#endif
+
+// Batch versions of the Geo.hpp operations over points stored as separate x and y arrays (SoA).
+// float and double run 4 or 2 points per instruction with SSE2; other scalars, and the
+// leftover tail, take the plain loop. Results match the one-point operators exactly;
+// normalizing a zero vector gives NaN either way, though not always with the same sign bit.
+
+template<typename T>
+struct PointSpan
+{
+    T *x;
+    T *y;
+    size_t count;
+
+    BasicPointVector<T> operator[](size_t idx) const
+    {return BasicPointVector<T>(x[idx], y[idx]);}
+    void set(size_t idx, const BasicPointVector<T> &pos) const
+    {
+        x[idx] = pos[0];
+        y[idx] = pos[1];
+    }
+};
+
+namespace _geo
+{
+    // Each returns how many leading points it handled; the callers finish the rest one by one
+    template<typename T>
+    inline size_t _transformWide(const PointSpan<T> &, const BasicMatrix2x2<T> &, const BasicPointVector<T> &)
+    {return 0;}
+    template<typename T>
+    inline size_t _normalizeWide(const PointSpan<T> &)
+    {return 0;}
+
+#ifdef _GEO_BATCH_SSE2
+    inline size_t _transformWide(const PointSpan<float> &points, const Matrix2x2F &m, const PointVectorF &offset)
+    {
+        const __m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]);
+        const __m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]);
+        const __m128 ox = _mm_set1_ps(offset[0]), oy = _mm_set1_ps(offset[1]);
+        size_t i = 0;
+        for(; i + 4 <= points.count; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(points.x + i), y = _mm_loadu_ps(points.y + i);
+            _mm_storeu_ps(points.x + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)), ox));
+            _mm_storeu_ps(points.y + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)), oy));
+        }
+        return i;
+    }
+    inline size_t _transformWide(const PointSpan<double> &points, const Matrix2x2 &m, const PointVector &offset)
+    {
+        const __m128d m00 = _mm_set1_pd(m[0][0]), m01 = _mm_set1_pd(m[0][1]);
+        const __m128d m10 = _mm_set1_pd(m[1][0]), m11 = _mm_set1_pd(m[1][1]);
+        const __m128d ox = _mm_set1_pd(offset[0]), oy = _mm_set1_pd(offset[1]);
+        size_t i = 0;
+        for(; i + 2 <= points.count; i += 2)
+        {
+            __m128d x = _mm_loadu_pd(points.x + i), y = _mm_loadu_pd(points.y + i);
+            _mm_storeu_pd(points.x + i, _mm_add_pd(_mm_add_pd(_mm_mul_pd(m00, x), _mm_mul_pd(m10, y)), ox));
+            _mm_storeu_pd(points.y + i, _mm_add_pd(_mm_add_pd(_mm_mul_pd(m01, x), _mm_mul_pd(m11, y)), oy));
+        }
+        return i;
+    }
+
+    // Real sqrt and division rather than the reciprocal estimates, so the result is the same as normalize()
+    inline size_t _normalizeWide(const PointSpan<float> &points)
+    {
+        size_t i = 0;
+        for(; i + 4 <= points.count; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(points.x + i), y = _mm_loadu_ps(points.y + i);
+            __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+            _mm_storeu_ps(points.x + i, _mm_div_ps(x, len)); // 0 / 0 is NaN, as in operator/
+            _mm_storeu_ps(points.y + i, _mm_div_ps(y, len));
+        }
+        return i;
+    }
+    inline size_t _normalizeWide(const PointSpan<double> &points)
+    {
+        size_t i = 0;
+        for(; i + 2 <= points.count; i += 2)
+        {
+            __m128d x = _mm_loadu_pd(points.x + i), y = _mm_loadu_pd(points.y + i);
+            __m128d len = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)));
+            _mm_storeu_pd(points.x + i, _mm_div_pd(x, len));
+            _mm_storeu_pd(points.y + i, _mm_div_pd(y, len));
+        }
+        return i;
+    }
+#endif
+}
+
+// points[i] = m * points[i] + offset
+template<typename T>
+inline void transformPoints(const PointSpan<T> &points, const BasicMatrix2x2<T> &m, const BasicPointVector<T> &offset = {})
+{
+    for(size_t i = _geo::_transformWide(points, m, offset); i < points.count; ++i)
+        points.set(i, m * points[i] + offset);
+}
+
+// Rotates every point about the origin
+template<typename T>
+inline void rotatePoints(const PointSpan<T> &points, double angle)
+{transformPoints(points, rotateMatrix<T>(angle));}
+
+template<typename T>
+inline void translatePoints(const PointSpan<T> &points, const BasicPointVector<T> &offset)
+{transformPoints(points, BasicMatrix2x2<T>(), offset);}
+
+template<typename T>
+inline void normalizePoints(const PointSpan<T> &points)
+{
+    for(size_t i = _geo::_normalizeWide(points); i < points.count; ++i)
+        points.set(i, points[i].normalized());
+}
+
+#endif // _GEO_BATCH_HPP_
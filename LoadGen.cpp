@@ -0,0 +1,428 @@
+// Headless load generator for the Z4 server.
+// Opens many client connections over loopback (or to any host), drives command streams and reports
+// input latency percentiles, snapshot rate and bytes per client per second.
+//
+// Usage: LoadGen [-h host] [-p port] [-n clients] [-t threads] [-d seconds] [-r commandsPerSecond]
+//                [-s script] [-u] [-l lossRate] [-c precision]
+//   -s  ';' separated command lines sent in a loop, e.g. "1;D0.5;2;D1.5". Random commands if omitted.
+//   -c  ask for compact snapshots quantized to this many world units (0 for the server default)
+//   -u  use the UDP transport instead of TCP
+//   -l  simulated outgoing loss for UDP clients
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "NetBase.hpp"
+#include "Udp.hpp"
+
+struct LoadGenConfig
+{
+    const char *host = "127.0.0.1";
+    uint16_t port = 1024;
+    size_t clients = 100;
+    size_t threads = 4;
+    double duration = 10.0;
+    double commandRate = 10.0;
+    std::vector<std::string> script;
+    bool udp = false;
+    double lossRate = 0.0;
+    bool compact = false;
+    double precision = 0.0;
+};
+
+struct LoadGenStats
+{
+    size_t connected = 0;
+    size_t failed = 0;
+    size_t snapshots = 0;
+    size_t bytes = 0;
+    size_t commands = 0;
+    std::vector<double> latencies; // Seconds from sending an input to the first snapshot that reflects it
+
+    void merge(const LoadGenStats &other)
+    {
+        connected += other.connected;
+        failed += other.failed;
+        snapshots += other.snapshots;
+        bytes += other.bytes;
+        commands += other.commands;
+        latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+    }
+};
+
+// One simulated player. Commands are numbered in the order they are sent; the server echoes how many
+// it has applied ("inputs" in myStat), which pairs each snapshot with the inputs it reflects.
+// Over UDP the echo is the number of the newest command applied, so one lost for good only costs
+// its own sample: it is timed to the first snapshot showing a later one.
+class LoadClient
+{
+public:
+    static constexpr size_t sendTimeHistory = 1024;
+private:
+    const LoadGenConfig &m_config;
+    SocketT m_sockFd;
+    std::unique_ptr<UdpClient> m_udp;
+    std::string m_inBuf;
+    std::string m_outBuf;
+    std::string m_snapshot;
+    bool m_framed; // TCP only: the server confirmed 'F' and now sends binary frames
+    CompactSnapshotDecoder m_decoder;
+    Snapshot m_decoded;
+    double m_sendTimes[sendTimeHistory]; // Negative for commands that are not inputs
+    uint32_t m_sent;
+    uint32_t m_acked;
+    size_t m_scriptPos;
+    double m_nextCommand;
+    bool m_alive;
+
+    // Over UDP our count follows the channel's command numbers, which the server echoes
+    void _sent(double sendTime)
+    {
+        m_sendTimes[m_sent % sendTimeHistory] = sendTime;
+        ++m_sent;
+    }
+    void _sentUdp(uint16_t seq, double sendTime)
+    {
+        m_sent += static_cast<uint16_t>(seq - m_sent);
+        _sent(sendTime);
+    }
+
+    // Lines the server could not decode would never be counted there, so they are not sent at all
+    void _command(const std::string &line, double now, LoadGenStats &stats)
+    {
+        NetCommand cmd;
+        if(!decodeCommand(line.c_str(), cmd))
+            return;
+        ++stats.commands;
+        if(m_udp)
+            _sentUdp(m_udp->command(cmd.op, cmd.args[0], cmd.args[1]), now);
+        else
+        {
+            _sent(now);
+            m_outBuf += line;
+            m_outBuf += '\n';
+        }
+    }
+
+    void _snapshotReceived(const std::string &snap, double now, LoadGenStats &stats)
+    {
+        ++stats.snapshots;
+        stats.bytes += snap.size();
+        uint32_t inputs;
+        if(CompactSnapshotDecoder::isCompact(snap.data(), snap.size()))
+        {
+            if(!m_decoder.decode(snap.data(), snap.size(), m_decoded))
+                return;
+            inputs = m_decoded.inputs;
+        }
+        else
+        {
+            const char *found = strstr(snap.c_str(), "\"inputs\":");
+            if(!found)
+                return;
+            inputs = static_cast<uint32_t>(strtoul(found + 9, nullptr, 10));
+        }
+        for(; m_acked < inputs && m_acked < m_sent; ++m_acked)
+            if(m_sent - m_acked <= sendTimeHistory && m_sendTimes[m_acked % sendTimeHistory] >= 0.0)
+                stats.latencies.push_back(now - m_sendTimes[m_acked % sendTimeHistory]);
+    }
+
+    void _pumpTcp(double now, LoadGenStats &stats)
+    {
+        while(!m_outBuf.empty())
+        {
+            int len = ::send(m_sockFd, m_outBuf.data(), static_cast<int>(m_outBuf.size()), NET_SEND_FLAGS);
+            if(len <= 0)
+            {
+                if(len < 0 && !wouldBlock())
+                    m_alive = false;
+                break;
+            }
+            m_outBuf.erase(0, len);
+        }
+        char received[4096];
+        for(;;)
+        {
+            int len = recv(m_sockFd, received, sizeof(received), 0);
+            if(len == 0 || (len < 0 && !wouldBlock()))
+            {
+                m_alive = false;
+                return;
+            }
+            if(len < 0)
+                break;
+            m_inBuf.append(received, len);
+        }
+        size_t pos = 0;
+        for(;;)
+        {
+            if(m_framed)
+            {
+                if(m_inBuf.size() - pos < 4)
+                    break;
+                _wire::_Reader rd = {reinterpret_cast<const uint8_t *>(m_inBuf.data() + pos), 4, 0, true};
+                size_t frameLen = rd.get32();
+                if(m_inBuf.size() - pos - 4 < frameLen)
+                    break;
+                m_snapshot.assign(m_inBuf, pos + 4, frameLen);
+                pos += 4 + frameLen;
+                _snapshotReceived(m_snapshot, now, stats);
+            }
+            else
+            {
+                size_t end = m_inBuf.find('\n', pos);
+                if(end == std::string::npos)
+                    break;
+                m_snapshot.assign(m_inBuf, pos, end + 1 - pos);
+                pos = end + 1;
+                if(m_snapshot == "COMPACT\n")
+                    m_framed = true;
+                else
+                    _snapshotReceived(m_snapshot, now, stats);
+            }
+        }
+        m_inBuf.erase(0, pos);
+    }
+public:
+    LoadClient(const LoadGenConfig &config)
+        : m_config(config), m_sockFd(INVALID_SOCKET), m_framed(false), m_sendTimes(), m_sent(0), m_acked(0), m_scriptPos(0),
+          m_nextCommand(0.0), m_alive(false){}
+    LoadClient(const LoadClient &) = delete;
+    ~LoadClient()
+    {
+        if(m_sockFd != INVALID_SOCKET)
+            closesocket(m_sockFd);
+    }
+
+    bool alive(void) const
+    {return m_alive;}
+
+    bool connect(uint32_t seed)
+    {
+        if(m_config.udp)
+        {
+            m_udp.reset(new UdpClient(4, m_config.lossRate, 0.0, seed));
+            m_alive = m_udp->connect(m_config.host, m_config.port);
+            return m_alive;
+        }
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_config.port);
+        if(inet_pton(AF_INET, m_config.host, &addr.sin_addr) != 1)
+            return false;
+        m_sockFd = socket(AF_INET, SOCK_STREAM, 0);
+        if(m_sockFd == INVALID_SOCKET)
+            return false;
+        if(::connect(m_sockFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+            return false;
+        int yes = 1;
+        setsockopt(m_sockFd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&yes), sizeof(yes));
+        setNonBlocking(m_sockFd);
+        m_alive = true;
+        return true;
+    }
+
+    void start(double now, double delay, LoadGenStats &stats)
+    {
+        if(m_config.compact)
+        {
+            char line[32];
+            snprintf(line, sizeof(line), "F%g", m_config.precision);
+            // Not an input: the server consumes 'F' in the I/O thread. Over UDP it still uses up a number
+            if(m_udp)
+                _sentUdp(m_udp->command('F', m_config.precision), -1.0);
+            else
+                (m_outBuf += line) += '\n';
+        }
+        _command("E800 800", now, stats);
+        m_nextCommand = now + delay;
+    }
+
+    void update(double now, std::mt19937 &rng, LoadGenStats &stats)
+    {
+        if(!m_alive)
+            return;
+        if(m_config.commandRate > 0.0 && now >= m_nextCommand)
+        {
+            if(!m_config.script.empty())
+            {
+                _command(m_config.script[m_scriptPos], now, stats);
+                m_scriptPos = (m_scriptPos + 1) % m_config.script.size();
+            }
+            else
+            {
+                static const char ops[] = "123456789AB";
+                std::uniform_int_distribution<size_t> pick(0, sizeof(ops) - 1); // The extra slot turns a direction
+                size_t idx = pick(rng);
+                char line[32];
+                if(idx == sizeof(ops) - 1)
+                    snprintf(line, sizeof(line), "D%.3f", std::uniform_real_distribution<double>(0.0, 6.283185307179586)(rng));
+                else
+                    snprintf(line, sizeof(line), "%c", ops[idx]);
+                _command(line, now, stats);
+            }
+            m_nextCommand += 1.0 / m_config.commandRate;
+        }
+        if(m_udp)
+        {
+            m_udp->pump(now);
+            while(m_udp->takeSnapshot(m_snapshot))
+                _snapshotReceived(m_snapshot, now, stats);
+            if(m_udp->closed())
+                m_alive = false;
+        }
+        else
+            _pumpTcp(now, stats);
+    }
+
+    void finish(double now, LoadGenStats &stats)
+    {
+        if(!m_alive)
+            return;
+        if(m_udp)
+        {
+            m_udp->disconnect();
+            m_udp->pump(now);
+        }
+        else
+        {
+            m_outBuf += "0\n";
+            _pumpTcp(now, stats);
+        }
+    }
+};
+
+void runWorker(const LoadGenConfig &config, size_t first, size_t count, std::atomic<bool> &go, LoadGenStats &stats)
+{
+    std::mt19937 rng(static_cast<uint32_t>(first * 7919 + 1));
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    for(size_t i = 0; i < count; ++i)
+    {
+        std::unique_ptr<LoadClient> client(new LoadClient(config));
+        if(client->connect(static_cast<uint32_t>(first + i + 1)))
+        {
+            ++stats.connected;
+            clients.push_back(std::move(client));
+        }
+        else
+            ++stats.failed;
+    }
+    while(!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+    // Spread the command streams out so the clients do not fire in lockstep
+    double begin = netNow();
+    std::uniform_real_distribution<double> jitter(0.0, (config.commandRate > 0.0) ? 1.0 / config.commandRate : 0.0);
+    for(auto &client : clients)
+        client->start(begin, jitter(rng), stats);
+    double now = begin;
+    while(now - begin < config.duration)
+    {
+        for(auto &client : clients)
+            client->update(now, rng, stats);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        now = netNow();
+    }
+    for(auto &client : clients)
+        client->finish(now, stats);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if(sorted.empty())
+        return 0.0;
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+int main(int argc, char **argv)
+{
+    LoadGenConfig config;
+    for(int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(!strcmp(arg, "-u"))
+            config.udp = true;
+        else if(!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        }
+        else
+        {
+            ++i;
+            if(!strcmp(arg, "-h")) config.host = value;
+            else if(!strcmp(arg, "-p")) config.port = static_cast<uint16_t>(atoi(value));
+            else if(!strcmp(arg, "-n")) config.clients = strtoul(value, nullptr, 10);
+            else if(!strcmp(arg, "-t")) config.threads = strtoul(value, nullptr, 10);
+            else if(!strcmp(arg, "-d")) config.duration = atof(value);
+            else if(!strcmp(arg, "-r")) config.commandRate = atof(value);
+            else if(!strcmp(arg, "-l")) config.lossRate = atof(value);
+            else if(!strcmp(arg, "-c"))
+            {
+                config.compact = true;
+                config.precision = atof(value);
+            }
+            else if(!strcmp(arg, "-s"))
+            {
+                std::string script = value;
+                size_t pos = 0;
+                while(pos <= script.size())
+                {
+                    size_t end = script.find(';', pos);
+                    if(end == std::string::npos)
+                        end = script.size();
+                    if(end > pos)
+                        config.script.push_back(script.substr(pos, end - pos));
+                    pos = end + 1;
+                }
+            }
+            else
+            {
+                fprintf(stderr, "Unknown option %s\n", arg);
+                return 1;
+            }
+        }
+    }
+    if(config.threads == 0)
+        config.threads = 1;
+    if(config.threads > config.clients)
+        config.threads = config.clients ? config.clients : 1;
+
+    std::atomic<bool> go(false);
+    std::vector<LoadGenStats> perThread(config.threads);
+    std::vector<std::thread> workers;
+    size_t first = 0;
+    for(size_t t = 0; t < config.threads; ++t)
+    {
+        size_t count = config.clients / config.threads + (t < config.clients % config.threads);
+        workers.emplace_back(runWorker, std::cref(config), first, count, std::ref(go), std::ref(perThread[t]));
+        first += count;
+    }
+    go.store(true, std::memory_order_release);
+    for(std::thread &worker : workers)
+        worker.join();
+
+    LoadGenStats total;
+    for(const LoadGenStats &stats : perThread)
+        total.merge(stats);
+    std::sort(total.latencies.begin(), total.latencies.end());
+    double clientSeconds = (total.connected ? total.connected : 1) * config.duration;
+    printf("transport        %s%s\n", config.udp ? "udp" : "tcp", config.compact ? ", compact snapshots" : "");
+    printf("clients          %zu connected, %zu failed\n", total.connected, total.failed);
+    printf("commands         %zu sent, %zu acknowledged\n", total.commands, total.latencies.size());
+    printf("snapshots        %.2f /s per client\n", total.snapshots / clientSeconds);
+    printf("bytes in         %.0f B/s per client\n", total.bytes / clientSeconds);
+    printf("input latency    p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+        percentile(total.latencies, 0.50) * 1000.0, percentile(total.latencies, 0.90) * 1000.0,
+        percentile(total.latencies, 0.99) * 1000.0, total.latencies.empty() ? 0.0 : total.latencies.back() * 1000.0);
+    return 0;
+}
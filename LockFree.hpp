@@ -0,0 +1,144 @@
+#ifndef _LOCK_FREE_HPP_
+#define _LOCK_FREE_HPP_
+
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+// Bounded queues used between the simulation thread and the I/O threads.
+// Neither of them allocates after construction, and neither of them ever blocks:
+// tryPush() fails when the queue is full, tryPop() fails when it is empty.
+
+namespace _lf
+{
+    static constexpr size_t _cacheLine = 64;
+
+    constexpr bool _isPowerOfTwo(size_t n)
+    {return n && !(n & (n - 1));}
+}
+
+// Single producer, single consumer ring buffer.
+template<typename T, size_t N>
+class SpscQueue
+{
+    static_assert(_lf::_isPowerOfTwo(N), "SpscQueue capacity must be a power of two");
+private:
+    static constexpr size_t m_mask = N - 1;
+
+    alignas(_lf::_cacheLine) std::atomic<size_t> m_head; // Written by the consumer
+    size_t m_tailCache;                                   // Consumer's view of m_tail
+    alignas(_lf::_cacheLine) std::atomic<size_t> m_tail; // Written by the producer
+    size_t m_headCache;                                   // Producer's view of m_head
+    alignas(_lf::_cacheLine) std::unique_ptr<T[]> m_slots;
+public:
+    SpscQueue()
+        : m_head(0), m_tailCache(0), m_tail(0), m_headCache(0), m_slots(new T[N]){}
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    static constexpr size_t capacity(void)
+    {return N;}
+
+    template<typename U>
+    bool tryPush(U &&value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if(tail - m_headCache == N)
+        {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if(tail - m_headCache == N)
+                return false;
+        }
+        m_slots[tail & m_mask] = std::forward<U>(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if(head == m_tailCache)
+        {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if(head == m_tailCache)
+                return false;
+        }
+        value = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only a hint when called from a thread that is neither the producer nor the consumer.
+    size_t sizeApprox(void) const
+    {return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);}
+};
+
+// Multiple producer, single consumer bounded queue (Vyukov's sequence-per-cell scheme).
+template<typename T, size_t N>
+class MpscQueue
+{
+    static_assert(_lf::_isPowerOfTwo(N), "MpscQueue capacity must be a power of two");
+private:
+    struct _Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    static constexpr size_t m_mask = N - 1;
+
+    alignas(_lf::_cacheLine) std::atomic<size_t> m_enqueuePos;
+    alignas(_lf::_cacheLine) size_t m_dequeuePos;
+    alignas(_lf::_cacheLine) std::unique_ptr<_Cell[]> m_cells;
+public:
+    MpscQueue()
+        : m_enqueuePos(0), m_dequeuePos(0), m_cells(new _Cell[N])
+    {
+        for(size_t i = 0; i < N; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    static constexpr size_t capacity(void)
+    {return N;}
+
+    template<typename U>
+    bool tryPush(U &&value)
+    {
+        _Cell *cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+            if(diff == 0)
+            {
+                if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if(diff < 0)
+                return false; // Full
+            else
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+        cell->value = std::forward<U>(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &value)
+    {
+        _Cell *cell = &m_cells[m_dequeuePos & m_mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        if(static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(m_dequeuePos + 1) < 0)
+            return false; // Empty (or the producer has not finished writing yet)
+        value = std::move(cell->value);
+        cell->seq.store(m_dequeuePos + N, std::memory_order_release);
+        ++m_dequeuePos;
+        return true;
+    }
+};
+
+#endif // _LOCK_FREE_HPP_
@@ -0,0 +1,425 @@
+#ifndef _LOG_HPP_
+#define _LOG_HPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "LockFree.hpp"
+#include "SteadyTimer.hpp"
+
+// Asynchronous logger.
+// logPrintln() never formats and never touches stdio: it copies the format pointer and the arguments
+// into a fixed size record and pushes it into the calling thread's ring. A background thread drains
+// every ring, formats the records printf style and writes them out in batches.
+// The format has to be a string literal (only the pointer is kept); string arguments are copied.
+// A full ring drops the record and counts it, a format logged more than rateLimit times a second
+// is swallowed until the next second. Neither ever blocks the caller.
+
+enum class LogLevel : uint8_t
+{
+    debug,
+    info,
+    warn,  // warn and error go to stderr, the rest to stdout
+    error,
+    off
+};
+
+namespace _log
+{
+    static constexpr size_t _maxArgs = 8;
+    static constexpr size_t _textSize = 64; // Shared by all the string arguments of one record
+    static constexpr size_t _rateSlots = 64;
+
+    enum class _ArgKind : uint8_t
+    {
+        none,
+        sint,
+        uint,
+        real,
+        text,   // Offset into LogRecord::text
+        pointer
+    };
+
+    union _ArgValue
+    {
+        int64_t sint;
+        uint64_t uint;
+        double real;
+        size_t text;
+        const void *pointer;
+    };
+}
+
+struct LogRecord
+{
+    const char *format = nullptr;
+    double time = 0.0;
+    LogLevel level = LogLevel::info;
+    uint8_t argCount = 0;
+    uint8_t textUsed = 0;
+    uint32_t suppressed = 0; // Repeats of this format the rate limiter swallowed before this one
+    _log::_ArgKind kinds[_log::_maxArgs];
+    _log::_ArgValue args[_log::_maxArgs];
+    char text[_log::_textSize];
+};
+
+namespace _log
+{
+    inline void _captureText(LogRecord &rec, const char *s, size_t len)
+    {
+        size_t room = _textSize - rec.textUsed;
+        if(len >= room)
+            len = room ? room - 1 : 0; // Truncated, but still terminated
+        rec.kinds[rec.argCount] = _ArgKind::text;
+        rec.args[rec.argCount].text = rec.textUsed;
+        if(room)
+        {
+            memcpy(rec.text + rec.textUsed, s, len);
+            rec.text[rec.textUsed + len] = '\0';
+            rec.textUsed += static_cast<uint8_t>(len + 1);
+        }
+        else
+            rec.args[rec.argCount].text = _textSize - 1;
+    }
+
+    inline void _capture(LogRecord &rec, const char *s)
+    {_captureText(rec, s ? s : "(null)", s ? strlen(s) : 6);}
+    inline void _capture(LogRecord &rec, char *s)
+    {_capture(rec, static_cast<const char *>(s));}
+    inline void _capture(LogRecord &rec, const std::string &s)
+    {_captureText(rec, s.data(), s.size());}
+    inline void _capture(LogRecord &rec, double v)
+    {
+        rec.kinds[rec.argCount] = _ArgKind::real;
+        rec.args[rec.argCount].real = v;
+    }
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type _capture(LogRecord &rec, T v)
+    {
+        if(std::is_signed<T>::value)
+        {
+            rec.kinds[rec.argCount] = _ArgKind::sint;
+            rec.args[rec.argCount].sint = static_cast<int64_t>(v);
+        }
+        else
+        {
+            rec.kinds[rec.argCount] = _ArgKind::uint;
+            rec.args[rec.argCount].uint = static_cast<uint64_t>(v);
+        }
+    }
+    template<typename T>
+    void _capture(LogRecord &rec, T *p)
+    {
+        rec.kinds[rec.argCount] = _ArgKind::pointer;
+        rec.args[rec.argCount].pointer = p;
+    }
+
+    inline int64_t _asSigned(const LogRecord &rec, size_t i)
+    {
+        switch(rec.kinds[i])
+        {
+        case _ArgKind::sint: return rec.args[i].sint;
+        case _ArgKind::uint: return static_cast<int64_t>(rec.args[i].uint);
+        case _ArgKind::real: return static_cast<int64_t>(rec.args[i].real);
+        default: return 0;
+        }
+    }
+    inline double _asReal(const LogRecord &rec, size_t i)
+    {
+        switch(rec.kinds[i])
+        {
+        case _ArgKind::sint: return static_cast<double>(rec.args[i].sint);
+        case _ArgKind::uint: return static_cast<double>(rec.args[i].uint);
+        case _ArgKind::real: return rec.args[i].real;
+        default: return 0.0;
+        }
+    }
+
+    // printf on the logger thread, one conversion at a time since the arguments are no longer a va_list.
+    // Length modifiers in the format are ignored: every integer was widened to 64 bits when captured.
+    inline void _format(std::string &out, const LogRecord &rec, double epoch)
+    {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "[%12.6lf]: ", rec.time - epoch);
+        out += buf;
+        size_t arg = 0;
+        const char *p = rec.format;
+        while(*p)
+        {
+            if(*p != '%')
+            {
+                const char *literal = p;
+                while(*p && *p != '%')
+                    ++p;
+                out.append(literal, p - literal);
+                continue;
+            }
+            if(p[1] == '%')
+            {
+                out += '%';
+                p += 2;
+                continue;
+            }
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while(*p && strchr("-+ #0123456789.", *p) && n < sizeof(spec) - 4)
+                spec[n++] = *p++;
+            while(*p && strchr("hlLqjzt", *p))
+                ++p;
+            char conversion = *p;
+            if(!conversion)
+                break;
+            ++p;
+            if(arg >= rec.argCount)
+            {
+                out += "(missing)";
+                continue;
+            }
+            switch(conversion)
+            {
+            case 'd': case 'i':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, static_cast<long long>(_asSigned(rec, arg)));
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, static_cast<unsigned long long>(_asSigned(rec, arg)));
+                break;
+            case 'c':
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, static_cast<int>(_asSigned(rec, arg)));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, _asReal(rec, arg));
+                break;
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, rec.kinds[arg] == _ArgKind::text ? rec.text + rec.args[arg].text : "(?)");
+                break;
+            case 'p':
+                snprintf(buf, sizeof(buf), "%p", rec.kinds[arg] == _ArgKind::pointer ? rec.args[arg].pointer : nullptr);
+                break;
+            default:
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), "%s", spec);
+                break;
+            }
+            ++arg;
+            out += buf;
+        }
+        if(rec.suppressed)
+        {
+            snprintf(buf, sizeof(buf), " (%u similar messages suppressed)", rec.suppressed);
+            out += buf;
+        }
+        out += '\n';
+    }
+}
+
+class Logger
+{
+public:
+    static constexpr size_t ringCapacity = 1024;  // Records per thread
+    static constexpr size_t batchLimit = 4096;    // Records formatted per write
+    static constexpr int idleSleepMs = 2;
+
+    struct ThreadLog
+    {
+        struct RateSlot
+        {
+            const char *format = nullptr;
+            double windowStart = 0.0;
+            uint32_t count = 0;
+            uint32_t suppressed = 0;
+        };
+        SpscQueue<LogRecord, ringCapacity> ring;
+        std::atomic<uint64_t> dropped{0};
+        RateSlot rates[_log::_rateSlots]; // Owning thread only, direct mapped by format pointer
+    };
+private:
+    std::mutex m_registryLock; // Taken when a thread logs for the first time, and by the logger thread
+    std::vector<std::unique_ptr<ThreadLog>> m_threads;
+    SteadyTimer m_timer;
+    std::atomic<LogLevel> m_level;
+    std::atomic<uint32_t> m_rateLimit; // Per format and thread, per second; 0 is unlimited
+    std::atomic<double> m_epoch;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    Logger()
+        : m_level(LogLevel::info), m_rateLimit(20), m_epoch(m_timer()), m_running(true)
+    {
+        m_thread = std::thread(&Logger::_run, this);
+    }
+    ThreadLog *_registerThread(void)
+    {
+        std::lock_guard<std::mutex> lock(m_registryLock);
+        m_threads.emplace_back(new ThreadLog);
+        return m_threads.back().get(); // Kept after the thread exits so nothing it logged is lost
+    }
+
+    // True if the rate limiter lets this one through; sets the count it swallowed since the last one
+    bool _admit(ThreadLog &log, const char *format, double now, uint32_t &suppressed)
+    {
+        uint32_t limit = m_rateLimit.load(std::memory_order_relaxed);
+        if(!limit)
+            return true;
+        ThreadLog::RateSlot &slot = log.rates[(reinterpret_cast<uintptr_t>(format) >> 3) % _log::_rateSlots];
+        if(slot.format != format) // Collisions just restart the window
+        {
+            slot = ThreadLog::RateSlot();
+            slot.format = format;
+            slot.windowStart = now;
+        }
+        else if(now - slot.windowStart >= 1.0)
+        {
+            slot.windowStart = now;
+            slot.count = 0;
+        }
+        if(++slot.count > limit)
+        {
+            ++slot.suppressed;
+            return false;
+        }
+        suppressed = slot.suppressed;
+        slot.suppressed = 0;
+        return true;
+    }
+
+    void _drain(std::vector<LogRecord> &batch, uint64_t &dropped)
+    {
+        std::lock_guard<std::mutex> lock(m_registryLock);
+        LogRecord rec;
+        for(const auto &log : m_threads)
+        {
+            while(batch.size() < batchLimit && log->ring.tryPop(rec))
+                batch.push_back(rec);
+            dropped += log->dropped.exchange(0, std::memory_order_relaxed);
+        }
+    }
+
+    void _run(void)
+    {
+        std::vector<LogRecord> batch;
+        std::string out, err;
+        batch.reserve(batchLimit);
+        for(;;)
+        {
+            bool running = m_running.load(std::memory_order_acquire);
+            uint64_t dropped = 0;
+            batch.clear();
+            _drain(batch, dropped);
+            if(batch.empty() && !dropped)
+            {
+                if(!running)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(idleSleepMs));
+                continue;
+            }
+            // Each ring is in order already, this only interleaves the threads
+            std::stable_sort(batch.begin(), batch.end(), [](const LogRecord &a, const LogRecord &b) {
+                return a.time < b.time;
+            });
+            double epoch = m_epoch.load(std::memory_order_relaxed);
+            out.clear();
+            err.clear();
+            for(const LogRecord &rec : batch)
+                _log::_format(rec.level >= LogLevel::warn ? err : out, rec, epoch);
+            if(dropped)
+            {
+                char buf[96];
+                snprintf(buf, sizeof(buf), "[%12.6lf]: (%llu log messages dropped)\n",
+                    m_timer() - epoch, static_cast<unsigned long long>(dropped));
+                err += buf;
+            }
+            if(!out.empty())
+            {
+                fwrite(out.data(), 1, out.size(), stdout);
+                fflush(stdout);
+            }
+            if(!err.empty())
+            {
+                fwrite(err.data(), 1, err.size(), stderr);
+                fflush(stderr);
+            }
+        }
+    }
+public:
+    static Logger &instance(void)
+    {
+        static Logger logger;
+        return logger;
+    }
+    Logger(const Logger &) = delete;
+    // Writes out whatever is still queued
+    ~Logger()
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+    }
+
+    void setLevel(LogLevel level)
+    {m_level.store(level, std::memory_order_relaxed);}
+    LogLevel level(void) const
+    {return m_level.load(std::memory_order_relaxed);}
+    void setRateLimit(uint32_t perSecond)
+    {m_rateLimit.store(perSecond, std::memory_order_relaxed);}
+    // Timestamps are printed relative to this
+    void setEpoch(double time)
+    {m_epoch.store(time, std::memory_order_relaxed);}
+
+    ThreadLog &threadLog(void)
+    {
+        thread_local ThreadLog *log = nullptr;
+        if(!log)
+            log = _registerThread();
+        return *log;
+    }
+
+    template<typename ...Args>
+    void write(LogLevel level, const char *format, const Args &...args)
+    {
+        static_assert(sizeof...(Args) <= _log::_maxArgs, "Too many log arguments");
+        if(level < m_level.load(std::memory_order_relaxed))
+            return;
+        ThreadLog &log = threadLog();
+        LogRecord rec;
+        rec.time = m_timer();
+        if(!_admit(log, format, rec.time, rec.suppressed))
+            return;
+        rec.format = format;
+        rec.level = level;
+        int expand[] = {0, (_log::_capture(rec, args), ++rec.argCount)...};
+        (void)expand;
+        if(!log.ring.tryPush(rec))
+            log.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+template<typename ...Args>
+inline void logPrintln(LogLevel level, const char *format, const Args &...args)
+{Logger::instance().write(level, format, args...);}
+
+#endif // _LOG_HPP_
@@ -0,0 +1,484 @@
+#ifndef _NET_HPP_
+#define _NET_HPP_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "NetBase.hpp"
+#include "LockFree.hpp"
+#include "Udp.hpp"
+#include "Profiler.hpp"
+
+class NetServer;
+
+// One I/O thread. Owns a set of sockets, turns their bytes into NetCommands and NetOutputs back into bytes.
+// The simulation threads never touch a socket.
+class NetThread
+{
+public:
+    static constexpr size_t outboundCapacity = 1024;
+    static constexpr size_t acceptCapacity = 256;
+    static constexpr size_t pendingLimit = 256;  // Stop reading a socket while this many commands wait for the sim
+    static constexpr int pollTimeoutMs = 1;
+    // Per-connection output policy. Snapshots are only encoded while the connection is below the high
+    // watermark; until it drains under the low one, each new snapshot replaces the previous unsent one.
+    // That keeps the buffer small, so a client that stopped reading is caught by how long it stays throttled.
+    static constexpr size_t outputLowWatermark = 16 * 1024;
+    static constexpr size_t outputHighWatermark = 64 * 1024;
+    static constexpr double stallTimeout = 10.0;         // Seconds throttled before we disconnect the client
+    static constexpr uint32_t maxSnapshotDivisor = 8;    // Slowest rate: every 8th tick
+    static constexpr uint32_t rateRecoverStreak = 60;    // Snapshots sent straight out before speeding up again
+    typedef MpscQueue<NetCommand, 8192> InboundQueue;
+    typedef MpscQueue<NetOutput, outboundCapacity> OutboundQueue; // Every room shard may send
+private:
+    struct Connection
+    {
+        SocketT sockFd;
+        uint32_t connId;
+        std::string lineBuf;
+        std::string outBuf;
+        std::deque<NetCommand> pending; // Decoded but not yet accepted by the inbound queue
+        std::unique_ptr<CompactSnapshotEncoder> compact; // Set once the client sent 'F'
+        std::unique_ptr<Snapshot> latest; // Newest snapshot not encoded yet
+        uint32_t snapshotDivisor;         // The sim sends this client a snapshot every Nth tick
+        uint32_t drainedStreak;
+        double throttledSince;
+        bool throttled;
+        bool closing;
+    };
+
+    NetServer *m_server;
+    uint32_t m_index;
+    uint32_t m_nextSlot;
+    InboundQueue &m_inbound;
+    OutboundQueue m_outbound;
+    SpscQueue<SocketT, acceptCapacity> m_accepted;
+    std::vector<Connection> m_conns;
+    std::unordered_map<uint32_t, size_t> m_connIndex; // connId -> position in m_conns
+    std::vector<pollfd> m_pollFds;
+    std::string m_frame;
+    std::atomic<size_t> m_bytesIn;
+    std::atomic<size_t> m_bytesOut;
+    std::atomic<size_t> m_snapshotsDropped;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    void _run(void);
+    void _adopt(SocketT sockFd);
+    void _readFrom(Connection &conn);
+    void _writeTo(Connection &conn);
+    void _flushPending(Connection &conn);
+    void _drainOutbound(void);
+    void _encodeLatest(Connection &conn);
+    void _setSnapshotDivisor(Connection &conn, uint32_t divisor);
+    Connection *_find(uint32_t connId);
+public:
+    NetThread(NetServer *server, uint32_t index, InboundQueue &inbound)
+        : m_server(server), m_index(index), m_nextSlot(0), m_inbound(inbound), m_bytesIn(0), m_bytesOut(0),
+          m_snapshotsDropped(0), m_running(false){}
+    NetThread(const NetThread &) = delete;
+    ~NetThread()
+    {stop();}
+
+    uint32_t index(void) const
+    {return m_index;}
+    size_t bytesIn(void) const
+    {return m_bytesIn.load(std::memory_order_relaxed);}
+    size_t bytesOut(void) const
+    {return m_bytesOut.load(std::memory_order_relaxed);}
+    // Snapshots superseded by a newer one before the client could take them
+    size_t snapshotsDropped(void) const
+    {return m_snapshotsDropped.load(std::memory_order_relaxed);}
+    // Called by the simulation threads.
+    bool send(NetOutput &&out)
+    {return m_outbound.tryPush(std::move(out));}
+    // Called by the accepting thread only.
+    bool adopt(SocketT sockFd)
+    {return m_accepted.tryPush(sockFd);}
+
+    void start(void)
+    {
+        m_running.store(true, std::memory_order_release);
+        m_thread = std::thread(&NetThread::_run, this);
+    }
+    void stop(void)
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+    }
+};
+
+// Listening socket plus a pool of NetThreads. Thread 0 also accepts and hands new sockets out round-robin.
+// connId carries the owning thread in its top byte, so routing output needs no shared table.
+// With UDP enabled, one more thread serves the datagram socket and its connIds use udpThreadIndex.
+class NetServer
+{
+public:
+    static constexpr uint32_t connIdThreadShift = 24;
+    static constexpr uint32_t udpThreadIndex = 0xFF;
+private:
+    SocketT m_listenFd;
+    uint16_t m_port;
+    size_t m_nextThread;
+    NetThread::InboundQueue m_inbound;
+    std::vector<std::unique_ptr<NetThread>> m_threads;
+    std::unique_ptr<UdpThread> m_udp;
+public:
+    NetServer(uint16_t port, size_t threadCount = 1)
+        : m_listenFd(INVALID_SOCKET), m_port(port), m_nextThread(0)
+    {
+        if(threadCount == 0)
+            threadCount = 1;
+        for(size_t i = 0; i < threadCount; ++i)
+            m_threads.emplace_back(new NetThread(this, static_cast<uint32_t>(i), m_inbound));
+    }
+    NetServer(const NetServer &) = delete;
+    ~NetServer()
+    {stop();}
+
+    SocketT listenFd(void) const
+    {return m_listenFd;}
+    UdpThread *udp(void) const
+    {return m_udp.get();}
+
+    // Call before start(). TCP keeps working alongside; the client picks the transport.
+    void enableUdp(const UdpThread::Config &config)
+    {m_udp.reset(new UdpThread(config, udpThreadIndex, connIdThreadShift, m_inbound));}
+
+    bool start(void)
+    {
+        m_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if(m_listenFd == INVALID_SOCKET)
+            return false;
+        int yes = 1;
+        setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(m_port);
+        if(bind(m_listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(m_listenFd, SOMAXCONN) != 0 || !setNonBlocking(m_listenFd))
+        {
+            closesocket(m_listenFd);
+            m_listenFd = INVALID_SOCKET;
+            return false;
+        }
+        if(m_udp && !m_udp->start())
+        {
+            closesocket(m_listenFd);
+            m_listenFd = INVALID_SOCKET;
+            return false;
+        }
+        for(auto &thread : m_threads)
+            thread->start();
+        return true;
+    }
+
+    void stop(void)
+    {
+        for(auto &thread : m_threads)
+            thread->stop();
+        if(m_udp)
+            m_udp->stop();
+        if(m_listenFd != INVALID_SOCKET)
+            closesocket(m_listenFd);
+        m_listenFd = INVALID_SOCKET;
+    }
+
+    size_t bytesIn(void) const
+    {
+        size_t total = 0;
+        for(const auto &thread : m_threads)
+            total += thread->bytesIn();
+        return total;
+    }
+    size_t bytesOut(void) const
+    {
+        size_t total = 0;
+        for(const auto &thread : m_threads)
+            total += thread->bytesOut();
+        return total;
+    }
+    size_t snapshotsDropped(void) const
+    {
+        size_t total = 0;
+        for(const auto &thread : m_threads)
+            total += thread->snapshotsDropped();
+        return total;
+    }
+
+    // Simulation side
+    NetThread::InboundQueue &inbound(void)
+    {return m_inbound;}
+    bool send(NetOutput &&out)
+    {
+        size_t idx = out.connId >> connIdThreadShift;
+        if(idx == udpThreadIndex)
+            return m_udp && m_udp->send(std::move(out));
+        return idx < m_threads.size() && m_threads[idx]->send(std::move(out));
+    }
+
+    // I/O side, thread 0 only
+    void acceptPending(void)
+    {
+        for(;;)
+        {
+            SocketT sockFd = accept(m_listenFd, nullptr, nullptr);
+            if(sockFd == INVALID_SOCKET)
+                return;
+            NetThread *target = m_threads[m_nextThread].get();
+            m_nextThread = (m_nextThread + 1) % m_threads.size();
+            if(!target->adopt(sockFd))
+                closesocket(sockFd); // Owner is saturated with new connections; refuse this one
+        }
+    }
+};
+
+inline NetThread::Connection *NetThread::_find(uint32_t connId)
+{
+    auto found = m_connIndex.find(connId);
+    return (found != m_connIndex.end()) ? &m_conns[found->second] : nullptr;
+}
+
+inline void NetThread::_adopt(SocketT sockFd)
+{
+    int yes = 1;
+    setNonBlocking(sockFd);
+    setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&yes), sizeof(yes));
+    Connection conn;
+    conn.sockFd = sockFd;
+    conn.connId = (m_index << NetServer::connIdThreadShift) | (m_nextSlot++ & ((1u << NetServer::connIdThreadShift) - 1));
+    conn.snapshotDivisor = 1;
+    conn.drainedStreak = 0;
+    conn.throttledSince = 0.0;
+    conn.throttled = false;
+    conn.closing = false;
+    NetCommand cmd;
+    cmd.connId = conn.connId;
+    cmd.kind = NetCommand::Kind::connected;
+    conn.pending.push_back(cmd);
+    m_connIndex[conn.connId] = m_conns.size();
+    m_conns.push_back(std::move(conn));
+}
+
+inline void NetThread::_flushPending(Connection &conn)
+{
+    while(!conn.pending.empty() && m_inbound.tryPush(conn.pending.front()))
+        conn.pending.pop_front();
+}
+
+inline void NetThread::_readFrom(Connection &conn)
+{
+    char received[512];
+    for(;;)
+    {
+        int len = recv(conn.sockFd, received, sizeof(received), 0);
+        if(len == 0 || (len < 0 && !wouldBlock()))
+        {
+            conn.closing = true;
+            return;
+        }
+        if(len < 0)
+            return;
+        m_bytesIn.fetch_add(len, std::memory_order_relaxed);
+        for(int i = 0; i < len; ++i)
+        {
+            if(received[i] == '\n')
+            {
+                NetCommand cmd;
+                cmd.connId = conn.connId;
+                if(decodeCommand(conn.lineBuf.c_str(), cmd))
+                {
+                    if(cmd.op != 'F')
+                        conn.pending.push_back(cmd);
+                    else
+                    {
+                        // Everything after this line is u32 length-prefixed binary frames
+                        if(!conn.compact)
+                            conn.outBuf += "COMPACT\n";
+                        conn.compact.reset(new CompactSnapshotEncoder(compactEncodingFor(cmd)));
+                    }
+                }
+                conn.lineBuf.clear();
+            }
+            else
+                conn.lineBuf += received[i];
+        }
+        if(conn.pending.size() >= pendingLimit)
+            return;
+    }
+}
+
+inline void NetThread::_writeTo(Connection &conn)
+{
+    PROFILE_ZONE(ProfileZoneId::send);
+    size_t sent = 0;
+    while(sent < conn.outBuf.size())
+    {
+        int len = ::send(conn.sockFd, conn.outBuf.data() + sent, static_cast<int>(conn.outBuf.size() - sent), NET_SEND_FLAGS);
+        if(len < 0)
+        {
+            if(!wouldBlock())
+                conn.closing = true;
+            break;
+        }
+        sent += len;
+    }
+    conn.outBuf.erase(0, sent);
+    m_bytesOut.fetch_add(sent, std::memory_order_relaxed);
+    if(conn.throttled && conn.outBuf.size() < outputLowWatermark)
+        conn.throttled = false;
+}
+
+// Tells the sim to change how often it builds snapshots for this client. Goes through pending like any
+// other command so it cannot be lost to a full inbound queue.
+inline void NetThread::_setSnapshotDivisor(Connection &conn, uint32_t divisor)
+{
+    if(divisor == conn.snapshotDivisor)
+        return;
+    conn.snapshotDivisor = divisor;
+    conn.drainedStreak = 0;
+    NetCommand cmd;
+    cmd.connId = conn.connId;
+    cmd.kind = NetCommand::Kind::snapshotRate;
+    cmd.args[0] = divisor;
+    conn.pending.push_back(cmd);
+}
+
+inline void NetThread::_encodeLatest(Connection &conn)
+{
+    if(!conn.latest || conn.throttled)
+        return;
+    PROFILE_ZONE(ProfileZoneId::snapshotEncode);
+    bool wasDrained = conn.outBuf.empty();
+    if(conn.compact)
+    {
+        m_frame.clear();
+        conn.compact->encode(*conn.latest, m_frame);
+        _wire::_put32(conn.outBuf, static_cast<uint32_t>(m_frame.size()));
+        conn.outBuf += m_frame;
+    }
+    else
+        encodeSnapshotJson(*conn.latest, conn.outBuf);
+    conn.latest.reset();
+    if(conn.outBuf.size() > outputHighWatermark)
+    {
+        conn.throttled = true;
+        conn.throttledSince = netNow();
+    }
+    if(!wasDrained)
+        conn.drainedStreak = 0; // Only snapshots sent straight out in a row count
+    else if(++conn.drainedStreak >= rateRecoverStreak && conn.snapshotDivisor > 1)
+        _setSnapshotDivisor(conn, conn.snapshotDivisor / 2);
+}
+
+inline void NetThread::_drainOutbound(void)
+{
+    NetOutput out;
+    while(m_outbound.tryPop(out))
+    {
+        Connection *conn = _find(out.connId);
+        if(!conn)
+            continue;
+        if(out.kind == NetOutput::Kind::close)
+            conn->closing = true;
+        else if(out.kind == NetOutput::Kind::snapshot && out.snapshot) // The text protocol has no event lines
+        {
+            // Latest snapshot wins: the one still waiting is stale now, and the client is not keeping up.
+            if(conn->latest)
+            {
+                m_snapshotsDropped.fetch_add(1, std::memory_order_relaxed);
+                _setSnapshotDivisor(*conn, (conn->snapshotDivisor < maxSnapshotDivisor) ? conn->snapshotDivisor * 2 : maxSnapshotDivisor);
+            }
+            conn->latest = std::move(out.snapshot);
+            _encodeLatest(*conn);
+        }
+        out.snapshot.reset();
+    }
+}
+
+inline void NetThread::_run(void)
+{
+    SocketT listenFd = (m_index == 0) ? m_server->listenFd() : INVALID_SOCKET;
+    while(m_running.load(std::memory_order_acquire))
+    {
+        SocketT sockFd;
+        while(m_accepted.tryPop(sockFd))
+            _adopt(sockFd);
+        _drainOutbound();
+
+        m_pollFds.clear();
+        for(Connection &conn : m_conns)
+        {
+            _flushPending(conn);
+            short events = 0;
+            if(!conn.closing && conn.pending.size() < pendingLimit)
+                events |= POLLIN;
+            if(!conn.outBuf.empty())
+                events |= POLLOUT;
+            m_pollFds.push_back(pollfd{conn.sockFd, events, 0});
+        }
+        if(listenFd != INVALID_SOCKET)
+            m_pollFds.push_back(pollfd{listenFd, POLLIN, 0});
+        if(poll(m_pollFds.data(), m_pollFds.size(), pollTimeoutMs) < 0)
+            continue;
+
+        for(size_t i = 0; i < m_conns.size(); ++i)
+        {
+            Connection &conn = m_conns[i];
+            short revents = m_pollFds[i].revents;
+            if(revents & (POLLIN | POLLHUP | POLLERR))
+                _readFrom(conn);
+            if(revents & POLLOUT)
+            {
+                _writeTo(conn);
+                _encodeLatest(conn);
+            }
+            _flushPending(conn);
+        }
+        if(listenFd != INVALID_SOCKET && (m_pollFds.back().revents & POLLIN))
+            m_server->acceptPending();
+
+        double now = netNow();
+        for(Connection &conn : m_conns) if(conn.throttled && now - conn.throttledSince > stallTimeout)
+            conn.closing = true;
+
+        // Closed connections stay around until the sim has been told about every command they sent.
+        for(size_t i = 0; i < m_conns.size();)
+        {
+            Connection &conn = m_conns[i];
+            if(conn.closing && conn.pending.empty())
+            {
+                NetCommand cmd;
+                cmd.connId = conn.connId;
+                cmd.kind = NetCommand::Kind::disconnected;
+                if(!m_inbound.tryPush(cmd))
+                {
+                    ++i;
+                    continue;
+                }
+                closesocket(conn.sockFd);
+                m_connIndex.erase(conn.connId);
+                if(i + 1 < m_conns.size())
+                {
+                    m_conns[i] = std::move(m_conns.back());
+                    m_connIndex[m_conns[i].connId] = i;
+                }
+                m_conns.pop_back();
+            }
+            else
+                ++i;
+        }
+    }
+    for(Connection &conn : m_conns)
+        closesocket(conn.sockFd);
+    m_conns.clear();
+    m_connIndex.clear();
+}
+
+#endif // _NET_HPP_
@@ -0,0 +1,124 @@
+#ifndef _NET_BASE_HPP_
+#define _NET_BASE_HPP_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#if defined(__unix__) || defined(__unix)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+typedef int SocketT;
+typedef socklen_t SockLenT;
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET (-1)
+#endif
+inline int closesocket(SocketT sockFd)
+{return close(sockFd);}
+inline bool setNonBlocking(SocketT sockFd)
+{
+    int flags = fcntl(sockFd, F_GETFL, 0);
+    return flags != -1 && fcntl(sockFd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+inline bool wouldBlock(void)
+{return errno == EAGAIN || errno == EWOULDBLOCK;}
+#define NET_SEND_FLAGS MSG_NOSIGNAL
+#elif defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET SocketT;
+typedef int SockLenT;
+#define poll WSAPoll
+inline bool setNonBlocking(SocketT sockFd)
+{
+    u_long mode = 1;
+    return ioctlsocket(sockFd, FIONBIO, &mode) == 0;
+}
+inline bool wouldBlock(void)
+{return WSAGetLastError() == WSAEWOULDBLOCK;}
+#define NET_SEND_FLAGS 0
+#endif
+#include "Snapshot.hpp"
+
+// Decoded input record, produced by an I/O thread and routed by the lobby to the shard running its room.
+struct NetCommand
+{
+    enum class Kind : uint8_t
+    {
+        connected,
+        disconnected,
+        input,
+        snapshotRate    // args[0]: send this client a snapshot every Nth tick
+    };
+    uint32_t connId = 0;
+    Kind kind = Kind::input;
+    char op = '\0';     // '0'..'E', see Player::_processCommand. 'F' never reaches the sim
+    double args[2] = {0.0, 0.0};
+    uint32_t seq = 0;   // UDP only: the client's number for this command, counting from 1. 0 over TCP
+};
+
+// Output record, produced by a room shard and consumed by the I/O thread owning connId.
+struct NetOutput
+{
+    enum class Kind : uint8_t
+    {
+        snapshot,
+        event,  // Small message that must arrive (e.g. "bye"); only the UDP transport carries these
+        close
+    };
+    uint32_t connId = 0;
+    Kind kind = Kind::snapshot;
+    std::unique_ptr<Snapshot> snapshot;
+    std::string event;
+};
+
+// 'F' is a transport option rather than a game command; the I/O threads answer it themselves.
+inline SnapshotEncoding compactEncodingFor(const NetCommand &cmd)
+{
+    SnapshotEncoding encoding;
+    if(cmd.args[0] > 0.0)
+        encoding.precision = cmd.args[0];
+    return encoding;
+}
+
+// Seconds on a monotonic clock, for I/O threads that must not depend on the sim's SteadyTimer.
+inline double netNow(void)
+{return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();}
+
+// Parses one '\n' terminated line of the text protocol. Returns false for unknown or empty commands.
+inline bool decodeCommand(const char *line, NetCommand &cmd)
+{
+    cmd.kind = NetCommand::Kind::input;
+    cmd.op = line[0];
+    switch(cmd.op)
+    {
+    case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+    case '8': case 'A': case 'B': case 'C':
+        return true;
+    case '9': // Optional: tick of the snapshot the client was looking at, for lag compensation
+        if(sscanf(line + 1, "%lf", &cmd.args[0]) != 1)
+            cmd.args[0] = 0.0;
+        return true;
+    case 'D':
+        return sscanf(line + 1, "%lf", &cmd.args[0]) == 1;
+    case 'E':
+        return sscanf(line + 1, "%lf %lf", &cmd.args[0], &cmd.args[1]) == 2;
+    case 'F': // Switch to compact snapshots; optional precision, see CompactSnapshotEncoder
+        if(sscanf(line + 1, "%lf", &cmd.args[0]) != 1)
+            cmd.args[0] = 0.0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif // _NET_BASE_HPP_
@@ -0,0 +1,123 @@
+#ifndef _OVERLOAD_HPP_
+#define _OVERLOAD_HPP_
+#include <stdint.h>
+#include <stddef.h>
+
+// One step of degradation; each level keeps what the ones before it gave up
+struct OverloadLevel
+{
+    uint32_t snapshotDivisor; // Room ticks per snapshot, on top of each client's own divisor
+    double lodScale;          // Multiplies the zombie LOD distances
+    uint32_t tickStride;      // Game ticks per room tick; the room ticks that much less often
+};
+
+// Counters for the stats line; summed over rooms, except level which is the worst one
+struct OverloadStats
+{
+    uint64_t level = 0;
+    uint64_t raises = 0;
+    uint64_t lowers = 0;
+    uint64_t overruns = 0;      // Room ticks that took longer than they had
+    uint64_t snapshotsShed = 0; // Not built because of snapshotDivisor
+};
+
+// Watches how long a room's ticks take and picks how much to give up so they keep fitting.
+// The average cost is compared with what a tick may take at the current stride: above highWater it
+// steps up a level, and it steps back down once the cost would stay under lowWater at the level
+// below for lowerAfter ticks in a row. After any change it waits holdTicks so the average can show
+// the effect before deciding again.
+class OverloadController
+{
+public:
+    static constexpr size_t levelCount = 4;
+private:
+    // A last level capping the live zombies of each wave goes after these once rooms spawn waves;
+    // for now nothing spawns zombies, so there is nothing to hold back
+    static constexpr OverloadLevel _levels[levelCount] = {
+        {1, 1.0, 1},
+        {2, 1.0, 1}, // Half the snapshots
+        {2, 0.5, 1}, // Fewer zombies get full updates
+        {1, 0.5, 2}  // Half the room ticks; snapshots stay at the same rate
+    };
+
+    double m_budget; // Seconds per game tick
+    double m_highWater;
+    double m_lowWater;
+    double m_smoothing;
+    uint32_t m_holdTicks;
+    uint32_t m_lowerAfter;
+    bool m_enabled;
+    size_t m_level;
+    double m_average;
+    uint32_t m_hold;
+    uint32_t m_cool;
+    OverloadStats m_stats;
+
+    double _load(size_t level) const
+    {return m_average / (m_budget * _levels[level].tickStride);}
+
+public:
+    OverloadController(double budget, bool enabled = true, double highWater = 0.8, double lowWater = 0.5,
+        double smoothing = 0.125, uint32_t holdTicks = 15, uint32_t lowerAfter = 90)
+        : m_budget(budget), m_highWater(highWater), m_lowWater(lowWater), m_smoothing(smoothing),
+          m_holdTicks(holdTicks), m_lowerAfter(lowerAfter), m_enabled(enabled), m_level(0), m_average(0.0),
+          m_hold(0), m_cool(0) {}
+
+    size_t levelIndex(void) const
+    {return m_level;}
+    const OverloadLevel &level(void) const
+    {return _levels[m_level];}
+    double averageCost(void) const
+    {return m_average;}
+    // How much of the current tick length the average tick takes
+    double load(void) const
+    {return _load(m_level);}
+
+    // Once per room tick, with how long it took; returns true if the level changed
+    bool record(double seconds)
+    {
+        if (seconds > m_budget * _levels[m_level].tickStride)
+            ++m_stats.overruns;
+        m_average += (seconds - m_average) * m_smoothing;
+        if (!m_enabled) return false;
+        if (m_hold)
+        {
+            --m_hold;
+            return false;
+        }
+        if (m_level + 1 < levelCount && _load(m_level) > m_highWater)
+        {
+            ++m_level;
+            ++m_stats.raises;
+            m_hold = m_holdTicks;
+            m_cool = 0;
+            return true;
+        }
+        if (m_level > 0 && _load(m_level - 1) < m_lowWater)
+        {
+            if (++m_cool < m_lowerAfter) return false;
+            --m_level;
+            ++m_stats.lowers;
+            m_hold = m_holdTicks;
+            m_cool = 0;
+            return true;
+        }
+        m_cool = 0;
+        return false;
+    }
+
+    void shedSnapshot(void)
+    {++m_stats.snapshotsShed;}
+
+    void collectStats(OverloadStats &stats) const
+    {
+        if (m_level > stats.level)
+            stats.level = m_level;
+        stats.raises += m_stats.raises;
+        stats.lowers += m_stats.lowers;
+        stats.overruns += m_stats.overruns;
+        stats.snapshotsShed += m_stats.snapshotsShed;
+    }
+};
+
+#endif // _OVERLOAD_HPP_
@@ -0,0 +1,214 @@
+#ifndef _PACKED_INDEX_HPP_
+#define _PACKED_INDEX_HPP_
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "TreeAlt.hpp" // PositionedObject, TreeStats
+
+// Spatial index for objects that rarely move, such as dropped items.
+// Everything lives in one flat array sorted as an implicit kd-tree: the middle entry of a range
+// splits it on x or y, alternating by level, and short ranges are just scanned. There are no nodes
+// to allocate. Changes go to a small side buffer and a removed entry is only blanked. Once enough
+// of them pile up, the next query rebuilds the array in one go.
+// Positions are read when an object is added. The index only notices a move made inside a query
+// callback, like QuadTreeNode; anything else should be removed and added again.
+class PackedIndex
+{
+private:
+    struct _Entry
+    {
+        PointVector pos;
+        PositionedObjectPtr obj; // Null once removed
+    };
+
+    std::vector<_Entry> m_packed;
+    std::vector<_Entry> m_pending; // Added since the last rebuild; scanned on every query
+    std::unordered_map<const PositionedObject *, size_t> m_slots; // Where each packed object sits
+    size_t m_removed; // Blank entries, in either array
+    size_t m_leafSize;
+    size_t m_minBatch;
+
+    void _build(size_t lo, size_t hi, size_t axis)
+    {
+        if (hi - lo <= m_leafSize) return;
+        size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(m_packed.begin() + lo, m_packed.begin() + mid, m_packed.begin() + hi,
+            [axis](const _Entry &a, const _Entry &b){return a.pos[axis] < b.pos[axis];});
+        _build(lo, mid, axis ^ 1);
+        _build(mid + 1, hi, axis ^ 1);
+    }
+
+    bool _needsRebuild() const
+    {
+        size_t changes = m_pending.size() + m_removed;
+        return changes >= m_minBatch && changes * 8 >= m_packed.size();
+    }
+
+    void _rebuild()
+    {
+        std::vector<_Entry> entries;
+        entries.reserve(size());
+        for (auto &entry : m_packed) if (entry.obj)
+            entries.push_back(std::move(entry));
+        for (auto &entry : m_pending) if (entry.obj)
+            entries.push_back(std::move(entry));
+        m_packed.swap(entries);
+        m_pending.clear();
+        m_removed = 0;
+        _build(0, m_packed.size(), 0);
+        m_slots.clear();
+        for (size_t i = 0; i < m_packed.size(); ++i)
+            m_slots[m_packed[i].obj.get()] = i;
+    }
+
+    void _blank(_Entry &entry)
+    {
+        m_slots.erase(entry.obj.get());
+        entry.obj.reset();
+        ++m_removed;
+    }
+
+    static bool _moved(const _Entry &entry)
+    {
+        const PointVector &pos = entry.obj->position();
+        return pos[0] != entry.pos[0] || pos[1] != entry.pos[1];
+    }
+
+    // After the callback: drop what was deleted, and send what moved through the side buffer
+    template <typename Func>
+    void _visit(_Entry &entry, const Bounds &area, Func &callback)
+    {
+        if (!entry.obj || !area.contains(entry.pos)) return;
+        PositionedObjectPtr obj = entry.obj;
+        callback(obj);
+        if (entry.obj != obj) return; // The callback removed it
+        if (!obj->valid())
+            _blank(entry);
+        else if (_moved(entry))
+        {
+            _blank(entry);
+            m_pending.push_back(_Entry{obj->position(), obj});
+        }
+    }
+
+    template <typename Func>
+    void _query(size_t lo, size_t hi, size_t axis, const Bounds &area, Func &callback)
+    {
+        if (hi - lo <= m_leafSize)
+        {
+            for (size_t i = lo; i < hi; ++i)
+                _visit(m_packed[i], area, callback);
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        double split = m_packed[mid].pos[axis];
+        if (area.minPoint()[axis] <= split)
+            _query(lo, mid, axis ^ 1, area, callback);
+        _visit(m_packed[mid], area, callback);
+        if (split <= area.maxPoint()[axis])
+            _query(mid + 1, hi, axis ^ 1, area, callback);
+    }
+
+    void _countNodes(size_t lo, size_t hi, size_t depth, TreeStats &stats) const
+    {
+        ++stats.nodes;
+        if (depth > stats.depth)
+            stats.depth = depth;
+        if (hi - lo <= m_leafSize)
+        {
+            ++stats.leaves;
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        _countNodes(lo, mid, depth + 1, stats);
+        _countNodes(mid + 1, hi, depth + 1, stats);
+    }
+
+public:
+    PackedIndex(size_t leafSize = 8, size_t minBatch = 32)
+        : m_removed(0), m_leafSize(leafSize ? leafSize : 1), m_minBatch(minBatch) {}
+
+    size_t size() const
+    {return m_packed.size() + m_pending.size() - m_removed;}
+
+    // Always succeeds; the bool keeps it a drop-in for QuadTreeNode
+    bool insert(PositionedObjectPtr obj)
+    {
+        m_pending.push_back(_Entry{obj->position(), std::move(obj)});
+        return true;
+    }
+
+    bool remove(const PositionedObjectPtr &obj)
+    {return remove(obj.get());}
+    bool remove(const PositionedObject *obj)
+    {
+        auto found = m_slots.find(obj);
+        if (found != m_slots.end())
+        {
+            _blank(m_packed[found->second]);
+            return true;
+        }
+        for (auto &entry : m_pending) if (entry.obj.get() == obj)
+        {
+            entry.obj.reset(); // Dropped at the next rebuild
+            ++m_removed;
+            return true;
+        }
+        return false;
+    }
+
+    template <typename Func>
+    void query(const Rect &area, Func &&callback)
+    {query(toBounds(area), callback);}
+
+    // The callback may insert and remove; nothing is rebuilt until the next query
+    template <typename Func>
+    void query(const Bounds &area, Func &&callback)
+    {
+        if (_needsRebuild())
+            _rebuild();
+        const size_t pending = m_pending.size(); // Not what moved in here during this query
+        _query(0, m_packed.size(), 0, area, callback);
+        for (size_t i = 0; i < pending; ++i)
+        {
+            if (!m_pending[i].obj || !area.contains(m_pending[i].pos)) continue;
+            PositionedObjectPtr obj = m_pending[i].obj;
+            callback(obj);
+            _Entry &entry = m_pending[i]; // The callback may have added to m_pending
+            if (entry.obj != obj) continue;
+            if (!obj->valid())
+            {
+                entry.obj.reset();
+                ++m_removed;
+            }
+            else
+                entry.pos = obj->position(); // Still pending, just somewhere else
+        }
+    }
+
+    // Packs everything now, e.g. after loading a level
+    void rebuild()
+    {_rebuild();}
+    // Does the rebuild the next query would do, so it happens at a time the caller picks
+    void maintain()
+    {
+        if (_needsRebuild())
+            _rebuild();
+    }
+
+    // Counts the implicit kd-tree ranges as nodes; pending objects count as objects only
+    void collectStats(TreeStats &stats, size_t depth = 1) const
+    {
+        stats.objects += size();
+        _countNodes(0, m_packed.size(), depth, stats);
+    }
+
+    void clear()
+    {
+        m_packed.clear();
+        m_pending.clear();
+        m_slots.clear();
+        m_removed = 0;
+    }
+};
+#endif
@@ -0,0 +1,244 @@
+#ifndef _POSITION_HISTORY_HPP_
+#define _POSITION_HISTORY_HPP_
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "Geo.hpp"
+
+// Where every entity was on each of the last few ticks, for rewinding hit tests to what a client saw.
+// Positions are quantized to a fixed step. Every keyInterval ticks a keyframe stores the ids (sorted)
+// and absolute coordinates; the ticks in between store 16 bit offsets from their keyframe, one per
+// keyframe id, so any tick is read without replaying others. Entities new since the keyframe, or too
+// far from where it saw them, go in a small sorted side list with absolute coordinates.
+// Every frame is a handful of flat arrays that keep their capacity, so after warming up nothing is
+// allocated and the memory is about 12 bytes per entity per keyframe and 4 per other tick.
+class PositionHistory
+{
+private:
+    static constexpr int16_t _absent = INT16_MIN; // No offset for this keyframe id on this tick
+
+    struct _Frame
+    {
+        uint32_t tick = 0;
+        uint32_t keyTick = 0;   // == tick for keyframes
+        bool used = false;
+        double maxStep = 0.0;   // Furthest any entity moved since the previous tick
+        bool contiguous = false; // The previous tick was recorded, so maxStep means something
+        // Keyframes
+        std::vector<uint32_t> ids;
+        std::vector<int32_t> x;
+        std::vector<int32_t> y;
+        // Other ticks, indexed like their keyframe's ids
+        std::vector<int16_t> dx;
+        std::vector<int16_t> dy;
+        // Other ticks: ids the offsets cannot describe
+        std::vector<uint32_t> extraIds;
+        std::vector<int32_t> extraX;
+        std::vector<int32_t> extraY;
+    };
+    struct _Sample
+    {
+        uint32_t id;
+        PointVector pos;
+    };
+
+    std::vector<_Frame> m_frames; // Ring, slot = tick % size
+    size_t m_keyInterval;
+    double m_step;
+    uint32_t m_newest;
+    bool m_empty;
+    std::vector<_Sample> m_current; // The tick being recorded
+    std::vector<_Sample> m_previous;
+
+    int32_t _quantize(double value) const
+    {return static_cast<int32_t>(std::lround(value / m_step));}
+    PointVector _position(int32_t x, int32_t y) const
+    {return PointVector(x * m_step, y * m_step);}
+
+    const _Frame *_frame(uint32_t tick) const
+    {
+        if (m_empty) return nullptr;
+        const _Frame &frame = m_frames[tick % m_frames.size()];
+        return (frame.used && frame.tick == tick) ? &frame : nullptr;
+    }
+
+    // Biggest move of any entity present on both ticks
+    double _maxStep(void) const
+    {
+        double step = 0.0;
+        auto prev = m_previous.begin();
+        for (const _Sample &cur : m_current)
+        {
+            while (prev != m_previous.end() && prev->id < cur.id)
+                ++prev;
+            if (prev == m_previous.end()) break;
+            if (prev->id != cur.id) continue;
+            double dist = std::max(std::fabs(cur.pos[0] - prev->pos[0]), std::fabs(cur.pos[1] - prev->pos[1]));
+            step = std::max(step, dist);
+        }
+        return step;
+    }
+
+    void _writeKey(_Frame &frame)
+    {
+        for (const _Sample &sample : m_current)
+        {
+            frame.ids.push_back(sample.id);
+            frame.x.push_back(_quantize(sample.pos[0]));
+            frame.y.push_back(_quantize(sample.pos[1]));
+        }
+    }
+
+    // One merge pass over two id-sorted lists, so the extras come out sorted too
+    void _writeDelta(_Frame &frame, const _Frame &key)
+    {
+        frame.dx.assign(key.ids.size(), _absent);
+        frame.dy.assign(key.ids.size(), _absent);
+        size_t k = 0;
+        for (const _Sample &sample : m_current)
+        {
+            while (k < key.ids.size() && key.ids[k] < sample.id)
+                ++k;
+            int32_t x = _quantize(sample.pos[0]), y = _quantize(sample.pos[1]);
+            if (k < key.ids.size() && key.ids[k] == sample.id)
+            {
+                int32_t dx = x - key.x[k], dy = y - key.y[k];
+                if (dx > _absent && dx <= INT16_MAX && dy > _absent && dy <= INT16_MAX)
+                {
+                    frame.dx[k] = static_cast<int16_t>(dx);
+                    frame.dy[k] = static_cast<int16_t>(dy);
+                    continue;
+                }
+            }
+            frame.extraIds.push_back(sample.id);
+            frame.extraX.push_back(x);
+            frame.extraY.push_back(y);
+        }
+    }
+
+public:
+    // ticks is rounded up to whole keyframe groups; step is the position resolution
+    PositionHistory(size_t ticks = 32, size_t keyInterval = 8, double step = 1.0 / 16.0)
+        : m_keyInterval(keyInterval ? keyInterval : 1), m_step(step), m_newest(0), m_empty(true)
+    {m_frames.resize((ticks + m_keyInterval - 1) / m_keyInterval * m_keyInterval);}
+
+    bool empty(void) const
+    {return m_empty;}
+    uint32_t newestTick(void) const
+    {return m_newest;}
+    // Oldest tick that can still be read
+    uint32_t oldestTick(void) const
+    {
+        uint32_t oldest = m_newest;
+        for (uint32_t back = 1; back < m_frames.size(); ++back)
+        {
+            const _Frame *frame = _frame(m_newest - back);
+            if (!frame || !_frame(frame->keyTick)) break;
+            oldest = m_newest - back;
+        }
+        return oldest;
+    }
+    double step(void) const
+    {return m_step;}
+
+    // Record one tick: beginTick, then add() for every entity in any order, then endTick
+    void beginTick(uint32_t tick)
+    {
+        m_current.clear();
+        m_newest = tick;
+    }
+    void add(uint32_t id, const PointVector &pos)
+    {
+        if (std::isfinite(pos[0]) && std::isfinite(pos[1]))
+            m_current.push_back(_Sample{id, pos});
+    }
+    void endTick(void)
+    {
+        std::sort(m_current.begin(), m_current.end(), [](const _Sample &a, const _Sample &b){return a.id < b.id;});
+        const uint32_t tick = m_newest;
+        _Frame &frame = m_frames[tick % m_frames.size()];
+        const bool contiguous = !m_empty && _frame(tick - 1);
+        frame.used = true;
+        frame.tick = tick;
+        frame.contiguous = contiguous;
+        frame.maxStep = contiguous ? _maxStep() : 0.0;
+        frame.ids.clear();
+        frame.x.clear();
+        frame.y.clear();
+        frame.dx.clear();
+        frame.dy.clear();
+        frame.extraIds.clear();
+        frame.extraX.clear();
+        frame.extraY.clear();
+        m_empty = false;
+
+        // After a gap the group's keyframe may be gone, so start a new one
+        const _Frame *key = contiguous ? _frame(m_frames[(tick - 1) % m_frames.size()].keyTick) : nullptr;
+        if (!key || tick % m_keyInterval == 0 || tick - key->tick >= m_keyInterval)
+        {
+            frame.keyTick = tick;
+            _writeKey(frame);
+        }
+        else
+        {
+            frame.keyTick = key->tick;
+            _writeDelta(frame, *key);
+        }
+        m_previous.swap(m_current);
+    }
+
+    // Where id was at the end of tick; false if it did not exist then or the tick is too old
+    bool positionAt(uint32_t tick, uint32_t id, PointVector &pos) const
+    {
+        const _Frame *frame = _frame(tick);
+        const _Frame *key = frame ? _frame(frame->keyTick) : nullptr;
+        if (!key) return false;
+        auto found = std::lower_bound(key->ids.begin(), key->ids.end(), id);
+        size_t k = found - key->ids.begin();
+        bool inKey = (found != key->ids.end() && *found == id);
+        if (frame == key)
+        {
+            if (!inKey) return false;
+            pos = _position(key->x[k], key->y[k]);
+            return true;
+        }
+        if (inKey && frame->dx[k] != _absent)
+        {
+            pos = _position(key->x[k] + frame->dx[k], key->y[k] + frame->dy[k]);
+            return true;
+        }
+        auto extra = std::lower_bound(frame->extraIds.begin(), frame->extraIds.end(), id);
+        if (extra == frame->extraIds.end() || *extra != id) return false;
+        size_t e = extra - frame->extraIds.begin();
+        pos = _position(frame->extraX[e], frame->extraY[e]);
+        return true;
+    }
+
+    // How far anything may have moved, on either axis, between the end of tick and the newest tick.
+    // Infinite if a tick in between was not recorded.
+    double driftSince(uint32_t tick) const
+    {
+        double drift = m_step; // Rounding
+        if (m_newest - tick >= m_frames.size()) return std::numeric_limits<double>::infinity();
+        for (uint32_t t = tick + 1; t != m_newest + 1; ++t)
+        {
+            const _Frame *frame = _frame(t);
+            if (!frame || !frame->contiguous) return std::numeric_limits<double>::infinity();
+            drift += frame->maxStep;
+        }
+        return drift;
+    }
+
+    void clear(void)
+    {
+        for (_Frame &frame : m_frames)
+            frame.used = false;
+        m_current.clear();
+        m_previous.clear();
+        m_empty = true;
+    }
+};
+
+#endif // _POSITION_HISTORY_HPP_
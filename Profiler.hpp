@@ -0,0 +1,356 @@
+#ifndef _PROFILER_HPP_
+#define _PROFILER_HPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__unix)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "SteadyTimer.hpp"
+
+// Tick profiler.
+// PROFILE_ZONE(ProfileZoneId::x) times the rest of the enclosing scope into a per-thread histogram.
+// Every thread writes only its own histograms, so recording is two clock reads and one relaxed store.
+// StatsExporter periodically merges them and writes one JSON line per interval.
+// Build with Z4_PROFILE_DISABLED to compile every zone out.
+
+enum class ProfileZoneId : size_t
+{
+    tick,           // Whole simulation tick
+    input,          // Draining the inbound command queue
+    update,         // Entity update()s; shots are hitscan, so this covers them too
+    tree,           // Spatial index maintenance: tuning the entity tree, rebuilding the item index
+    snapshotBuild,  // Filling Snapshot records on the sim thread
+    snapshotEncode, // Turning them into bytes on an I/O thread
+    send,           // Pushing output to the I/O threads, and socket writes on them
+    checkpoint,     // Building a world checkpoint image; the disk write is on its own thread
+    count
+};
+
+enum class ProfileGaugeId : size_t
+{
+    players,
+    entities,
+    items,
+    treeNodes,
+    treeDepth,
+    bytesIn,
+    bytesOut,
+    snapshotsDropped,
+    overloadLevel,  // Worst room
+    overloadRaises, // The rest are totals since start, over every room
+    overloadLowers,
+    tickOverruns,
+    snapshotsShed,
+    count
+};
+
+namespace _prof
+{
+    static constexpr const char *_zoneNames[] = {
+        "tick", "input", "update", "tree", "snapshotBuild", "snapshotEncode", "send", "checkpoint"
+    };
+    static constexpr const char *_gaugeNames[] = {
+        "players", "entities", "items", "treeNodes", "treeDepth", "bytesIn", "bytesOut", "snapshotsDropped",
+        "overloadLevel", "overloadRaises", "overloadLowers", "tickOverruns", "snapshotsShed"
+    };
+    static_assert(sizeof(_zoneNames) / sizeof(*_zoneNames) == static_cast<size_t>(ProfileZoneId::count), "zone names");
+    static_assert(sizeof(_gaugeNames) / sizeof(*_gaugeNames) == static_cast<size_t>(ProfileGaugeId::count), "gauge names");
+
+    inline int _msb(uint64_t v)
+    {
+        int msb = 0;
+        while(v >>= 1)
+            ++msb;
+        return msb;
+    }
+}
+
+// Log-linear histogram of nanosecond values (HDR style): 32 linear sub-buckets per power of two,
+// so every recorded value is kept to about 3% precision up to 2^40 ns.
+class HdrHistogram
+{
+public:
+    static constexpr int subBucketBits = 5;
+    static constexpr uint64_t subBucketCount = uint64_t(1) << subBucketBits;
+    static constexpr int maxMsb = 40;
+    static constexpr size_t slotCount = (maxMsb - subBucketBits + 2) * subBucketCount;
+
+    static size_t indexOf(uint64_t value)
+    {
+        if(value < subBucketCount)
+            return static_cast<size_t>(value);
+        int msb = _prof::_msb(value);
+        if(msb > maxMsb)
+            return slotCount - 1;
+        uint64_t sub = (value >> (msb - subBucketBits)) & (subBucketCount - 1);
+        return static_cast<size_t>((msb - subBucketBits + 1) * subBucketCount + sub);
+    }
+    static uint64_t valueAt(size_t index)
+    {
+        uint64_t bucket = index / subBucketCount;
+        uint64_t sub = index % subBucketCount;
+        return bucket ? (subBucketCount + sub) << (bucket - 1) : sub;
+    }
+private:
+    std::atomic<uint64_t> m_counts[slotCount];
+public:
+    HdrHistogram()
+    {
+        for(auto &count : m_counts)
+            count.store(0, std::memory_order_relaxed);
+    }
+    // Owning thread only
+    void record(uint64_t value)
+    {
+        std::atomic<uint64_t> &slot = m_counts[indexOf(value)];
+        slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    // Any thread; counts only ever grow, so a reader diffs against its previous copy
+    void addTo(std::vector<uint64_t> &counts) const
+    {
+        counts.resize(slotCount);
+        for(size_t i = 0; i < slotCount; ++i)
+            counts[i] += m_counts[i].load(std::memory_order_relaxed);
+    }
+};
+
+// Plain copy of histogram counts, for percentiles on the reading side.
+struct HistogramView
+{
+    std::vector<uint64_t> counts;
+
+    uint64_t total(void) const
+    {
+        uint64_t n = 0;
+        for(uint64_t c : counts)
+            n += c;
+        return n;
+    }
+    // Value (ns) at quantile q in [0, 1]
+    uint64_t percentile(double q) const
+    {
+        uint64_t n = total();
+        if(!n)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (n - 1)) + 1, seen = 0;
+        for(size_t i = 0; i < counts.size(); ++i)
+            if((seen += counts[i]) >= rank)
+                return HdrHistogram::valueAt(i);
+        return 0;
+    }
+    uint64_t max(void) const
+    {
+        for(size_t i = counts.size(); i > 0; --i)
+            if(counts[i - 1])
+                return HdrHistogram::valueAt(i - 1);
+        return 0;
+    }
+};
+
+class Profiler
+{
+public:
+    struct ThreadData
+    {
+        HdrHistogram zones[static_cast<size_t>(ProfileZoneId::count)];
+    };
+private:
+    std::mutex m_registryLock; // Taken only when a thread records for the first time, and by readers
+    std::vector<std::unique_ptr<ThreadData>> m_threads;
+    std::atomic<int64_t> m_gauges[static_cast<size_t>(ProfileGaugeId::count)];
+    SteadyTimer m_timer;
+
+    Profiler()
+    {
+        for(auto &gauge : m_gauges)
+            gauge.store(0, std::memory_order_relaxed);
+    }
+    ThreadData *_registerThread(void)
+    {
+        std::lock_guard<std::mutex> lock(m_registryLock);
+        m_threads.emplace_back(new ThreadData);
+        return m_threads.back().get(); // Kept after the thread exits, its counts stay valid
+    }
+public:
+    static Profiler &instance(void)
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    double now(void) const
+    {return m_timer();}
+
+    ThreadData &threadData(void)
+    {
+        thread_local ThreadData *data = nullptr;
+        if(!data)
+            data = _registerThread();
+        return *data;
+    }
+
+    void record(ProfileZoneId zone, double seconds)
+    {threadData().zones[static_cast<size_t>(zone)].record(seconds > 0.0 ? static_cast<uint64_t>(seconds * 1e9) : 0);}
+
+    void setGauge(ProfileGaugeId gauge, int64_t value)
+    {m_gauges[static_cast<size_t>(gauge)].store(value, std::memory_order_relaxed);}
+    int64_t gauge(ProfileGaugeId gauge) const
+    {return m_gauges[static_cast<size_t>(gauge)].load(std::memory_order_relaxed);}
+
+    // Cumulative counts for one zone, summed over every thread that ever recorded it
+    void collect(ProfileZoneId zone, HistogramView &view)
+    {
+        view.counts.assign(HdrHistogram::slotCount, 0);
+        std::lock_guard<std::mutex> lock(m_registryLock);
+        for(const auto &data : m_threads)
+            data->zones[static_cast<size_t>(zone)].addTo(view.counts);
+    }
+};
+
+class ProfileZone
+{
+private:
+    ProfileZoneId m_zone;
+    double m_start;
+public:
+    explicit ProfileZone(ProfileZoneId zone)
+        : m_zone(zone), m_start(Profiler::instance().now()){}
+    ProfileZone(const ProfileZone &) = delete;
+    ~ProfileZone()
+    {
+        Profiler &profiler = Profiler::instance();
+        profiler.record(m_zone, profiler.now() - m_start);
+    }
+};
+
+#define _PROFILE_CONCAT2(a, b) a##b
+#define _PROFILE_CONCAT(a, b) _PROFILE_CONCAT2(a, b)
+#ifndef Z4_PROFILE_DISABLED
+#define PROFILE_ZONE(zone) ProfileZone _PROFILE_CONCAT(_profileZone, __LINE__)(zone)
+#define PROFILE_GAUGE(gauge, value) Profiler::instance().setGauge((gauge), static_cast<int64_t>(value))
+#else
+#define PROFILE_ZONE(zone) ((void)0)
+#define PROFILE_GAUGE(gauge, value) ((void)0)
+#endif
+
+// Background thread that writes one JSON line per interval: p50/p90/p99/max per zone over that interval
+// (in microseconds), plus the current gauges. Goes to a file (appended) or a Unix datagram socket.
+class StatsExporter
+{
+private:
+    std::string m_filePath;
+    std::string m_socketPath;
+    double m_interval;
+    std::vector<HistogramView> m_previous;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    void _format(std::string &line, double time)
+    {
+        Profiler &profiler = Profiler::instance();
+        char buf[256];
+        snprintf(buf, sizeof(buf), "{\"t\":%.3f,\"zones\":{", time);
+        line = buf;
+        HistogramView cur, delta;
+        for(size_t z = 0; z < static_cast<size_t>(ProfileZoneId::count); ++z)
+        {
+            profiler.collect(static_cast<ProfileZoneId>(z), cur);
+            delta.counts.resize(cur.counts.size());
+            for(size_t i = 0; i < cur.counts.size(); ++i)
+                delta.counts[i] = cur.counts[i] - m_previous[z].counts[i];
+            m_previous[z].counts.swap(cur.counts);
+            snprintf(buf, sizeof(buf), "%s\"%s\":{\"n\":%llu,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+                z ? "," : "", _prof::_zoneNames[z], static_cast<unsigned long long>(delta.total()),
+                delta.percentile(0.50) * 1e-3, delta.percentile(0.90) * 1e-3, delta.percentile(0.99) * 1e-3, delta.max() * 1e-3);
+            line += buf;
+        }
+        line += "},\"gauges\":{";
+        for(size_t g = 0; g < static_cast<size_t>(ProfileGaugeId::count); ++g)
+        {
+            snprintf(buf, sizeof(buf), "%s\"%s\":%lld", g ? "," : "", _prof::_gaugeNames[g],
+                static_cast<long long>(profiler.gauge(static_cast<ProfileGaugeId>(g))));
+            line += buf;
+        }
+        line += "}}\n";
+    }
+
+    void _run(void)
+    {
+        std::string line;
+        double start = Profiler::instance().now(), next = start + m_interval;
+#if defined(__unix__) || defined(__unix)
+        int sockFd = -1;
+        sockaddr_un addr = {};
+        if(!m_socketPath.empty() && m_socketPath.size() < sizeof(addr.sun_path))
+        {
+            sockFd = socket(AF_UNIX, SOCK_DGRAM, 0);
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, m_socketPath.c_str(), m_socketPath.size() + 1);
+        }
+#endif
+        while(m_running.load(std::memory_order_acquire))
+        {
+            double now = Profiler::instance().now();
+            if(now < next)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                continue;
+            }
+            next += m_interval;
+            _format(line, now - start);
+            if(!m_filePath.empty())
+            {
+                FILE *file = fopen(m_filePath.c_str(), "a");
+                if(file)
+                {
+                    fwrite(line.data(), 1, line.size(), file);
+                    fclose(file);
+                }
+            }
+#if defined(__unix__) || defined(__unix)
+            if(sockFd != -1) // Nobody listening is fine; the datagram is just dropped
+                sendto(sockFd, line.data(), line.size(), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+#endif
+        }
+#if defined(__unix__) || defined(__unix)
+        if(sockFd != -1)
+            close(sockFd);
+#endif
+    }
+public:
+    StatsExporter(const std::string &filePath, const std::string &socketPath = std::string(), double interval = 1.0)
+        : m_filePath(filePath), m_socketPath(socketPath), m_interval(interval),
+          m_previous(static_cast<size_t>(ProfileZoneId::count)), m_running(false)
+    {
+        for(HistogramView &view : m_previous)
+            view.counts.assign(HdrHistogram::slotCount, 0);
+    }
+    StatsExporter(const StatsExporter &) = delete;
+    ~StatsExporter()
+    {stop();}
+
+    void start(void)
+    {
+        m_running.store(true, std::memory_order_release);
+        m_thread = std::thread(&StatsExporter::_run, this);
+    }
+    void stop(void)
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+    }
+};
+
+#endif // _PROFILER_HPP_
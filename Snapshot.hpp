@@ -0,0 +1,516 @@
+#ifndef _SNAPSHOT_HPP_
+#define _SNAPSHOT_HPP_
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Wire.hpp"
+
+// Plain snapshot records. The simulation thread fills them in, the I/O threads encode them,
+// so nothing in here may point back into the live game state.
+struct EntityState
+{
+    uint32_t id;
+    double x;
+    double y;
+    double size;
+    int team;
+    int hp;
+    int hpMax;
+};
+
+struct BulletState
+{
+    double x;
+    double y;
+};
+
+struct ItemState
+{
+    double x;
+    double y;
+    double size;
+    const char *name; // Always a string literal
+};
+
+struct Snapshot
+{
+    uint32_t tick = 0;
+    double time = 0.0;   // Simulation time of this tick, in seconds
+    uint32_t inputs = 0; // Input commands the server has applied for this player so far; over UDP, the
+                         // client's number of the newest one, since lost ones leave gaps
+    int ammo = 0;
+    int ammoMax = 0;
+    double reloadingTime = 0.0;
+    double reloadingRemain = 0.0;
+    EntityState me = {};
+    EntityState crystal = {};
+    int zombRemain = 0;
+    std::vector<EntityState> entities;
+    std::vector<BulletState> bullets;
+    std::vector<ItemState> dropItems;
+
+    void clear(void)
+    {
+        entities.clear();
+        bullets.clear();
+        dropItems.clear();
+    }
+};
+
+namespace _snap
+{
+    // Formats straight into out; a line longer than the first guess is formatted again at its real length
+    inline void _append(std::string &out, const char *format, ...)
+    {
+        const size_t start = out.size();
+        size_t room = 128;
+        va_list args, retry;
+        va_start(args, format);
+        va_copy(retry, args);
+        out.resize(start + room);
+        int len = vsnprintf(&out[start], room + 1, format, args); // Its terminator lands on the string's own
+        if(len >= 0 && static_cast<size_t>(len) > room)
+        {
+            room = static_cast<size_t>(len);
+            out.resize(start + room);
+            len = vsnprintf(&out[start], room + 1, format, retry);
+        }
+        va_end(retry);
+        va_end(args);
+        out.resize(start + ((len > 0) ? static_cast<size_t>(len) : 0));
+    }
+
+    inline void _entity(std::string &out, const EntityState &ent)
+    {
+        _append(out, "{\"id\":%u,\"team\":%d,\"x\":%.17g,\"y\":%.17g,\"size\":%.17g,\"hp\":%d,\"hpMax\":%d}",
+            ent.id, ent.team, ent.x, ent.y, ent.size, ent.hp, ent.hpMax);
+    }
+}
+
+// Writes one snapshot as a single line of JSON in the layout Z4.pde expects.
+inline void encodeSnapshotJson(const Snapshot &snap, std::string &out)
+{
+    using namespace _snap;
+    _append(out, "{\"myStat\":{\"inputs\":%u,\"ammo\":%d,\"ammoMax\":%d,\"reloadingTime\":%.17g,\"reloadingRemain\":%.17g,\"ent\":",
+        snap.inputs, snap.ammo, snap.ammoMax, snap.reloadingTime, snap.reloadingRemain);
+    _entity(out, snap.me);
+    out += "},\"crystalStat\":";
+    _entity(out, snap.crystal);
+    _append(out, ",\"gameStat\":{\"zombRemain\":%d},\"entities\":[", snap.zombRemain);
+    for(size_t i = 0; i < snap.entities.size(); ++i)
+    {
+        if(i) out += ',';
+        _entity(out, snap.entities[i]);
+    }
+    out += "],\"bullets\":[";
+    for(size_t i = 0; i < snap.bullets.size(); ++i)
+        _append(out, "%s{\"x\":%.17g,\"y\":%.17g}", i ? "," : "", snap.bullets[i].x, snap.bullets[i].y);
+    out += "],\"dropItems\":[";
+    for(size_t i = 0; i < snap.dropItems.size(); ++i)
+    {
+        const ItemState &item = snap.dropItems[i];
+        _append(out, "%s{\"name\":\"%s\",\"x\":%.17g,\"y\":%.17g,\"size\":%.17g}", i ? "," : "", item.name, item.x, item.y, item.size);
+    }
+    out += "]}\n";
+}
+
+// Compact binary snapshots, opted into per connection with the 'F' command.
+// Positions are fixed-point offsets from the receiving player in units of `precision`, and every entity
+// carries a velocity hint. Each frame is a delta against a baseline: an earlier frame the client is
+// known to have. An entity whose extrapolated baseline position is still within `tolerance` of where
+// it really is gets left out, and the client carries it over from the baseline. Entities the baseline
+// has but that dropped out of view are listed by id, in every frame until the baseline moves past.
+// Baseline 0 means "from nothing".
+//
+//  u8 magic, u32 frame, u32 baseline, f32 precision, u32 tick, f64 time, u32 inputs, u16 ammo,
+//  u16 ammoMax, f32 reloadingTime, f32 reloadingRemain, u32 zombRemain, me and crystal (absolute),
+//  var entityCount, entities, var goneCount, var ids, var bulletCount, bullets, var itemCount, items
+//  absolute entity: var id, f64 x, f64 y, u8 team, u16 size, u16 hp, u16 hpMax
+//  entity:          var id, i16 x, i16 y, i16 vx, i16 vy, u8 team, u16 size, u16 hp, u16 hpMax
+//  bullet:          i16 x, i16 y
+//  item:            i16 x, i16 y, u16 size, u8 nameLength, name
+struct SnapshotEncoding
+{
+    double precision = 0.125; // World units per quantum
+    double tolerance = 1.0;   // Largest extrapolation error (world units) we let the client live with
+    double maxSkipAge = 0.5;  // Resend a skipped entity at least this often anyway
+    bool reliable = true;     // Every frame arrives, in order (TCP): each one is the next one's baseline.
+                              // Otherwise the transport calls acknowledge() for the frames that arrived
+};
+
+namespace _snap
+{
+    static constexpr uint8_t _compactMagic = 0xC5;
+
+    // False when the value does not fit, which for positions means "outside anything a client draws".
+    inline bool _quantize(double value, double precision, int16_t &q)
+    {
+        double scaled = floor(value / precision + 0.5);
+        if(!(scaled >= -32768.0 && scaled <= 32767.0))
+            return false;
+        q = static_cast<int16_t>(scaled);
+        return true;
+    }
+
+    inline uint16_t _clamp16(double value)
+    {return (value <= 0.0) ? 0 : (value >= 65535.0) ? 65535 : static_cast<uint16_t>(value + 0.5);}
+
+    inline void _absEntity(std::string &out, const EntityState &ent, double precision)
+    {
+        using namespace _wire;
+        _putVar(out, ent.id);
+        _putDouble(out, ent.x);
+        _putDouble(out, ent.y);
+        _put8(out, static_cast<uint8_t>(ent.team));
+        _put16(out, _clamp16(ent.size / precision));
+        _put16(out, _clamp16(ent.hp));
+        _put16(out, _clamp16(ent.hpMax));
+    }
+
+    inline void _readAbsEntity(_wire::_Reader &rd, EntityState &ent, double precision)
+    {
+        ent.id = rd.getVar();
+        ent.x = rd.getDouble();
+        ent.y = rd.getDouble();
+        ent.team = static_cast<int8_t>(rd.get8());
+        ent.size = rd.get16() * precision;
+        ent.hp = rd.get16();
+        ent.hpMax = rd.get16();
+    }
+}
+
+// Server side. One per connection, since what may be skipped depends on what this client already has.
+class CompactSnapshotEncoder
+{
+public:
+    static constexpr size_t frameHistory = 64; // Frames kept waiting for an ack; older ones cannot be baselines
+private:
+    struct _Sent // What the client shows for one entity, as of some frame
+    {
+        uint32_t id;
+        double x, y;        // After quantization
+        double vx, vy;
+        double time;        // When x, y were actually sent
+        int hp;
+        int team;
+    };
+    struct _Frame
+    {
+        uint32_t id;
+        std::vector<_Sent> entities; // Sorted by id
+    };
+    struct _Seen // Last real observation, for the velocity estimate
+    {
+        double x, y, time;
+        uint32_t frame;
+    };
+    SnapshotEncoding m_encoding;
+    std::deque<_Frame> m_frames; // Sent, oldest first; the front is the baseline once one is acked
+    uint32_t m_nextFrame;
+    uint32_t m_baseline;         // 0 until the client has confirmed a frame
+    std::unordered_map<uint32_t, _Seen> m_seen;
+    std::string m_body;
+    size_t m_sent;
+    size_t m_skipped;
+
+    const _Frame *_frame(uint32_t id) const
+    {
+        for(const _Frame &frame : m_frames) if(frame.id == id)
+            return &frame;
+        return nullptr;
+    }
+    static const _Sent *_find(const _Frame *frame, uint32_t id)
+    {
+        if(!frame)
+            return nullptr;
+        auto found = std::lower_bound(frame->entities.begin(), frame->entities.end(), id,
+            [](const _Sent &sent, uint32_t id){return sent.id < id;});
+        return (found != frame->entities.end() && found->id == id) ? &*found : nullptr;
+    }
+public:
+    CompactSnapshotEncoder(const SnapshotEncoding &encoding = SnapshotEncoding())
+        : m_encoding(encoding), m_nextFrame(1), m_baseline(0), m_sent(0), m_skipped(0){}
+
+    const SnapshotEncoding &encoding(void) const
+    {return m_encoding;}
+    size_t sent(void) const
+    {return m_sent;}
+    size_t skipped(void) const
+    {return m_skipped;}
+    // Id of the frame the last encode() wrote
+    uint32_t lastFrame(void) const
+    {return m_nextFrame - 1;}
+
+    // The client has frame, so later frames may build on it. Acks for frames older than the
+    // current baseline, or too old to remember, change nothing.
+    void acknowledge(uint32_t frame)
+    {
+        if(frame <= m_baseline || !_frame(frame))
+            return;
+        m_baseline = frame;
+        while(m_frames.front().id != frame)
+            m_frames.pop_front();
+    }
+
+    void encode(const Snapshot &snap, std::string &out)
+    {
+        using namespace _wire;
+        using namespace _snap;
+        const double p = m_encoding.precision;
+        const double ox = snap.me.x, oy = snap.me.y;
+        const _Frame *base = _frame(m_baseline);
+        const uint32_t frameId = m_nextFrame++;
+        _Frame frame;
+        frame.id = frameId;
+
+        _put8(out, _compactMagic);
+        _put32(out, frameId);
+        _put32(out, base ? base->id : 0);
+        _putFloat(out, static_cast<float>(p));
+        _put32(out, snap.tick);
+        _putDouble(out, snap.time);
+        _put32(out, snap.inputs);
+        _put16(out, _clamp16(snap.ammo));
+        _put16(out, _clamp16(snap.ammoMax));
+        _putFloat(out, static_cast<float>(snap.reloadingTime));
+        _putFloat(out, static_cast<float>(snap.reloadingRemain));
+        _put32(out, static_cast<uint32_t>(snap.zombRemain));
+        _absEntity(out, snap.me, p);
+        _absEntity(out, snap.crystal, p);
+
+        m_body.clear();
+        size_t count = 0;
+        for(const EntityState &ent : snap.entities)
+        {
+            int16_t qx, qy;
+            if(!_quantize(ent.x - ox, p, qx) || !_quantize(ent.y - oy, p, qy))
+                continue;
+            auto seen = m_seen.find(ent.id);
+            double vx = 0.0, vy = 0.0;
+            if(seen != m_seen.end() && snap.time > seen->second.time)
+            {
+                vx = (ent.x - seen->second.x) / (snap.time - seen->second.time);
+                vy = (ent.y - seen->second.y) / (snap.time - seen->second.time);
+            }
+            m_seen[ent.id] = _Seen{ent.x, ent.y, snap.time, frameId};
+
+            const _Sent *known = _find(base, ent.id);
+            if(known && known->hp == ent.hp && known->team == ent.team && snap.time - known->time < m_encoding.maxSkipAge)
+            {
+                double dt = snap.time - known->time;
+                double ex = known->x + known->vx * dt - ent.x;
+                double ey = known->y + known->vy * dt - ent.y;
+                if(ex * ex + ey * ey <= m_encoding.tolerance * m_encoding.tolerance)
+                {
+                    frame.entities.push_back(*known);
+                    ++m_skipped;
+                    continue;
+                }
+            }
+            int16_t qvx, qvy;
+            if(!_quantize(vx, p, qvx) || !_quantize(vy, p, qvy))
+                qvx = qvy = 0;
+            frame.entities.push_back(_Sent{ent.id, ox + qx * p, oy + qy * p, qvx * p, qvy * p, snap.time, ent.hp, ent.team});
+            _putVar(m_body, ent.id);
+            _put16(m_body, static_cast<uint16_t>(qx));
+            _put16(m_body, static_cast<uint16_t>(qy));
+            _put16(m_body, static_cast<uint16_t>(qvx));
+            _put16(m_body, static_cast<uint16_t>(qvy));
+            _put8(m_body, static_cast<uint8_t>(ent.team));
+            _put16(m_body, _clamp16(ent.size / p));
+            _put16(m_body, _clamp16(ent.hp));
+            _put16(m_body, _clamp16(ent.hpMax));
+            ++count;
+        }
+        m_sent += count;
+        _putVar(out, static_cast<uint32_t>(count));
+        out += m_body;
+        std::sort(frame.entities.begin(), frame.entities.end(), [](const _Sent &a, const _Sent &b){return a.id < b.id;});
+
+        // Gone relative to the baseline, so a lost frame cannot leave one behind on the client
+        m_body.clear();
+        count = 0;
+        if(base)
+        {
+            for(const _Sent &sent : base->entities) if(!_find(&frame, sent.id))
+            {
+                _putVar(m_body, sent.id);
+                ++count;
+            }
+        }
+        _putVar(out, static_cast<uint32_t>(count));
+        out += m_body;
+        for(auto i = m_seen.begin(); i != m_seen.end();)
+        {
+            if(i->second.frame != frameId)
+                i = m_seen.erase(i);
+            else
+                ++i;
+        }
+
+        m_body.clear();
+        count = 0;
+        for(const BulletState &bullet : snap.bullets)
+        {
+            int16_t qx, qy;
+            if(!_quantize(bullet.x - ox, p, qx) || !_quantize(bullet.y - oy, p, qy))
+                continue;
+            _put16(m_body, static_cast<uint16_t>(qx));
+            _put16(m_body, static_cast<uint16_t>(qy));
+            ++count;
+        }
+        _putVar(out, static_cast<uint32_t>(count));
+        out += m_body;
+
+        m_body.clear();
+        count = 0;
+        for(const ItemState &item : snap.dropItems)
+        {
+            int16_t qx, qy;
+            if(!_quantize(item.x - ox, p, qx) || !_quantize(item.y - oy, p, qy))
+                continue;
+            size_t nameLen = strlen(item.name);
+            if(nameLen > 255)
+                nameLen = 255;
+            _put16(m_body, static_cast<uint16_t>(qx));
+            _put16(m_body, static_cast<uint16_t>(qy));
+            _put16(m_body, _clamp16(item.size / p));
+            _put8(m_body, static_cast<uint8_t>(nameLen));
+            m_body.append(item.name, nameLen);
+            ++count;
+        }
+        _putVar(out, static_cast<uint32_t>(count));
+        out += m_body;
+
+        // Without acks for a while the baseline falls out of the history and the next frame is a full one
+        m_frames.push_back(std::move(frame));
+        if(m_frames.size() > frameHistory)
+            m_frames.pop_front();
+        if(m_encoding.reliable)
+            acknowledge(frameId);
+    }
+};
+
+// Client side. Keeps the entity table of the frames it decoded recently, rebuilds each new frame
+// from its baseline and extrapolates the entities it was not sent, then hands back an ordinary
+// Snapshot in absolute coordinates. Decode every frame that arrives, late ones too: the server may
+// build on any frame it hears was received.
+// A frame's baseline is at most CompactSnapshotEncoder::frameHistory frames older than it, and the
+// encoder forgets frames that much older than its newest. Keeping twice that many ids behind the
+// newest frame decoded here therefore keeps every baseline the server can still pick.
+// Item names point into m_names.
+class CompactSnapshotDecoder
+{
+public:
+    static constexpr uint32_t frameHistory = 2 * CompactSnapshotEncoder::frameHistory;
+private:
+    struct _Track
+    {
+        EntityState state;
+        double vx, vy;
+        double time;
+    };
+    typedef std::unordered_map<uint32_t, _Track> _Tracks;
+    std::map<uint32_t, _Tracks> m_frames; // By frame id
+    std::vector<std::string> m_names;
+public:
+    static bool isCompact(const void *data, size_t size)
+    {return size && *static_cast<const uint8_t *>(data) == _snap::_compactMagic;}
+
+    // False for garbage, or when the frame's baseline is no longer (or never was) here
+    bool decode(const void *data, size_t size, Snapshot &snap)
+    {
+        using namespace _snap;
+        _wire::_Reader rd = {static_cast<const uint8_t *>(data), size, 0, true};
+        if(rd.get8() != _compactMagic)
+            return false;
+        uint32_t frameId = rd.get32(), baseline = rd.get32();
+        auto base = m_frames.find(baseline);
+        if(!rd.ok || (baseline && base == m_frames.end()))
+            return false;
+        _Tracks tracks;
+        if(baseline)
+            tracks = base->second;
+
+        snap.clear();
+        double p = rd.getFloat();
+        snap.tick = rd.get32();
+        snap.time = rd.getDouble();
+        snap.inputs = rd.get32();
+        snap.ammo = rd.get16();
+        snap.ammoMax = rd.get16();
+        snap.reloadingTime = rd.getFloat();
+        snap.reloadingRemain = rd.getFloat();
+        snap.zombRemain = static_cast<int>(rd.get32());
+        _readAbsEntity(rd, snap.me, p);
+        _readAbsEntity(rd, snap.crystal, p);
+        const double ox = snap.me.x, oy = snap.me.y;
+
+        for(uint32_t count = rd.getVar(); count && rd.ok; --count)
+        {
+            _Track track;
+            EntityState &ent = track.state;
+            ent.id = rd.getVar();
+            ent.x = ox + static_cast<int16_t>(rd.get16()) * p;
+            ent.y = oy + static_cast<int16_t>(rd.get16()) * p;
+            track.vx = static_cast<int16_t>(rd.get16()) * p;
+            track.vy = static_cast<int16_t>(rd.get16()) * p;
+            ent.team = static_cast<int8_t>(rd.get8());
+            ent.size = rd.get16() * p;
+            ent.hp = rd.get16();
+            ent.hpMax = rd.get16();
+            track.time = snap.time;
+            tracks[ent.id] = track;
+        }
+        for(uint32_t count = rd.getVar(); count && rd.ok; --count)
+            tracks.erase(rd.getVar());
+        for(const auto &entry : tracks)
+        {
+            const _Track &track = entry.second;
+            EntityState ent = track.state;
+            ent.x += track.vx * (snap.time - track.time);
+            ent.y += track.vy * (snap.time - track.time);
+            snap.entities.push_back(ent);
+        }
+
+        for(uint32_t count = rd.getVar(); count && rd.ok; --count)
+        {
+            double x = ox + static_cast<int16_t>(rd.get16()) * p;
+            double y = oy + static_cast<int16_t>(rd.get16()) * p;
+            snap.bullets.push_back(BulletState{x, y});
+        }
+        m_names.clear();
+        std::vector<ItemState> items;
+        for(uint32_t count = rd.getVar(); count && rd.ok; --count)
+        {
+            ItemState item;
+            item.x = ox + static_cast<int16_t>(rd.get16()) * p;
+            item.y = oy + static_cast<int16_t>(rd.get16()) * p;
+            item.size = rd.get16() * p;
+            size_t nameLen = rd.get8();
+            const char *name = rd.bytes(nameLen);
+            m_names.emplace_back(name ? name : "", name ? nameLen : 0);
+            items.push_back(item);
+        }
+        for(size_t i = 0; i < items.size(); ++i)
+            items[i].name = m_names[i].c_str();
+        snap.dropItems.swap(items);
+        if(!rd.ok)
+            return false;
+
+        m_frames[frameId].swap(tracks);
+        while(m_frames.begin()->first + frameHistory < m_frames.rbegin()->first)
+            m_frames.erase(m_frames.begin());
+        return true;
+    }
+};
+
+#endif // _SNAPSHOT_HPP_
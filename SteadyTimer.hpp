@@ -2,6 +2,27 @@
 #define _STEADY_TIMER_HPP_
 
 #if defined(__unix__) || defined(__linux__)
+#include <time.h>
+class SteadyTimer
+{
+public:
+    bool __getTime(double &time) const
+    {
+        timespec ts;
+        if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        {
+            time = static_cast<double>(ts.tv_sec) + ts.tv_nsec * 1e-9;
+            return true;
+        }
+        return false;
+    }
+public:
+    double operator()(void) const
+    {
+        double currentTime;
+        return __getTime(currentTime) ? currentTime : 0.0;
+    }
+};
 #elif defined(_WIN32) || defined(_WIN64)
 #include <profileapi.h>
 class SteadyTimer
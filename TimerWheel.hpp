@@ -0,0 +1,242 @@
+#ifndef _TIMER_WHEEL_HPP_
+#define _TIMER_WHEEL_HPP_
+#include <stdint.h>
+#include <vector>
+#include <functional>
+
+class TimerWheel;
+
+// One pending wakeup, owned by whoever wants to be woken. Destroying or rescheduling it cancels
+// the old one, so an entity that dies never gets called back.
+class Timer
+{
+    friend class TimerWheel;
+private:
+    TimerWheel *m_wheel = nullptr;
+    uint32_t m_index = 0;
+    uint32_t m_generation = 0;
+public:
+    Timer() = default;
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+    ~Timer()
+    {cancel();}
+    inline bool pending(void) const;
+    inline uint64_t remaining(void) const; // Ticks until it fires; 0 if it is not pending
+    inline void cancel(void);
+};
+
+// Hierarchical timer wheel counted in game ticks: four levels of 64 slots, each slot of a level
+// spanning a whole turn of the level below. A timer sits in the lowest level whose turn it falls
+// in and moves down as that turn comes up, so advancing one tick costs one slot plus the timers
+// that move or fire, however many are waiting. Timers further out than 2^24 ticks wait in an
+// overflow list that is looked at once per top level turn.
+// Callbacks run inside advance(), in the tick they are due; they may schedule and cancel freely.
+// The wheel has to outlive every Timer scheduled on it.
+class TimerWheel
+{
+    friend class Timer;
+public:
+    static constexpr uint32_t slotBits = 6;
+    static constexpr uint32_t slotCount = 1 << slotBits;
+    static constexpr uint32_t levelCount = 4;
+private:
+    static constexpr uint32_t _none = UINT32_MAX;
+    static constexpr uint32_t _overflow = levelCount * slotCount;
+    static constexpr uint32_t _firing = _overflow + 1;
+    static constexpr uint32_t _listCount = _firing + 1;
+
+    struct _Node
+    {
+        uint64_t due = 0;
+        uint32_t prev = _none;
+        uint32_t next = _none;
+        uint32_t list = _none; // _none while free
+        uint32_t generation = 0;
+        std::function<void(void)> callback;
+    };
+
+    std::vector<_Node> m_nodes;
+    uint32_t m_free;
+    uint32_t m_heads[_listCount];
+    uint64_t m_now;
+    size_t m_pending;
+    double m_tickSeconds;
+
+    void _link(uint32_t index, uint32_t list)
+    {
+        _Node &node = m_nodes[index];
+        node.list = list;
+        node.prev = _none;
+        node.next = m_heads[list];
+        if (node.next != _none)
+            m_nodes[node.next].prev = index;
+        m_heads[list] = index;
+    }
+    void _unlink(uint32_t index)
+    {
+        _Node &node = m_nodes[index];
+        if (node.prev != _none)
+            m_nodes[node.prev].next = node.next;
+        else
+            m_heads[node.list] = node.next;
+        if (node.next != _none)
+            m_nodes[node.next].prev = node.prev;
+        node.prev = node.next = _none;
+    }
+    void _release(uint32_t index)
+    {
+        _Node &node = m_nodes[index];
+        node.list = _none;
+        ++node.generation;
+        node.next = m_free;
+        m_free = index;
+        --m_pending;
+    }
+
+    // The lowest level whose current turn the due tick falls in
+    void _place(uint32_t index)
+    {
+        const uint64_t due = m_nodes[index].due;
+        if (due <= m_now)
+        {
+            _link(index, _firing);
+            return;
+        }
+        for (uint32_t level = 0; level < levelCount; ++level)
+        {
+            const uint32_t shift = slotBits * (level + 1);
+            if ((due >> shift) == (m_now >> shift))
+            {
+                _link(index, level * slotCount + ((due >> (shift - slotBits)) & (slotCount - 1)));
+                return;
+            }
+        }
+        _link(index, _overflow);
+    }
+
+    void _cascade(uint32_t list)
+    {
+        uint32_t index = m_heads[list];
+        m_heads[list] = _none;
+        while (index != _none)
+        {
+            uint32_t next = m_nodes[index].next;
+            _place(index);
+            index = next;
+        }
+    }
+
+    void _fire(void)
+    {
+        while (m_heads[_firing] != _none)
+        {
+            uint32_t index = m_heads[_firing];
+            _unlink(index);
+            // Moved out first: the callback may well destroy the object that holds its Timer
+            std::function<void(void)> callback = std::move(m_nodes[index].callback);
+            m_nodes[index].callback = nullptr;
+            _release(index);
+            callback();
+        }
+    }
+
+    void _step(void)
+    {
+        ++m_now;
+        // Higher levels first, so a timer can move down more than one level in the same tick
+        uint32_t level = 1;
+        while (level < levelCount && (m_now & ((uint64_t(1) << (slotBits * level)) - 1)) == 0)
+            ++level;
+        if (level == levelCount)
+            _cascade(_overflow);
+        while (--level > 0)
+            _cascade(level * slotCount + ((m_now >> (slotBits * level)) & (slotCount - 1)));
+        _cascade(m_now & (slotCount - 1));
+        _fire();
+    }
+
+public:
+    TimerWheel(double tickSeconds = 1.0 / 30.0)
+        : m_free(_none), m_now(0), m_pending(0), m_tickSeconds(tickSeconds)
+    {
+        for (uint32_t &head : m_heads)
+            head = _none;
+    }
+    TimerWheel(const TimerWheel &) = delete;
+
+    uint64_t now(void) const
+    {return m_now;}
+    size_t pending(void) const
+    {return m_pending;}
+    double tickSeconds(void) const
+    {return m_tickSeconds;}
+    // Whole ticks, rounded up, so a cooldown is never shorter than asked
+    uint64_t ticks(double seconds) const
+    {
+        if (!(seconds > 0.0)) return 0;
+        double count = seconds / m_tickSeconds;
+        uint64_t whole = static_cast<uint64_t>(count);
+        return (whole < count) ? whole + 1 : whole;
+    }
+
+    // Calls callback delay ticks from now; 0 means during the next advance()
+    void schedule(Timer &timer, uint64_t delay, std::function<void(void)> callback)
+    {
+        timer.cancel();
+        uint32_t index = m_free;
+        if (index != _none)
+            m_free = m_nodes[index].next;
+        else
+        {
+            index = static_cast<uint32_t>(m_nodes.size());
+            m_nodes.emplace_back();
+        }
+        _Node &node = m_nodes[index];
+        node.due = m_now + delay;
+        node.callback = std::move(callback);
+        ++m_pending;
+        _place(index);
+        timer.m_wheel = this;
+        timer.m_index = index;
+        timer.m_generation = node.generation;
+    }
+    void scheduleIn(Timer &timer, double seconds, std::function<void(void)> callback)
+    {schedule(timer, ticks(seconds), std::move(callback));}
+
+    // Runs every tick up to and including tick, firing what falls due on each
+    void advance(uint64_t tick)
+    {
+        _fire(); // Anything scheduled for "now" since the last call
+        while (m_now < tick)
+            _step();
+    }
+};
+
+inline bool Timer::pending(void) const
+{
+    return m_wheel && m_wheel->m_nodes[m_index].generation == m_generation
+        && m_wheel->m_nodes[m_index].list != TimerWheel::_none;
+}
+
+inline uint64_t Timer::remaining(void) const
+{
+    if (!pending()) return 0;
+    uint64_t due = m_wheel->m_nodes[m_index].due;
+    return (due > m_wheel->m_now) ? due - m_wheel->m_now : 0;
+}
+
+inline void Timer::cancel(void)
+{
+    if (!pending())
+    {
+        m_wheel = nullptr;
+        return;
+    }
+    m_wheel->_unlink(m_index);
+    m_wheel->m_nodes[m_index].callback = nullptr;
+    m_wheel->_release(m_index);
+    m_wheel = nullptr;
+}
+
+#endif // _TIMER_WHEEL_HPP_
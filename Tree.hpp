@@ -4,6 +4,9 @@
 #include "Geo.hpp"
 #include <stdio.h>
 #include <list>
+#include <vector>
+#include <utility>
+#include <type_traits>
 
 // Is it 2D version of segment tree?
 // Copilot, ask there.
@@ -23,15 +26,29 @@ namespace _qt
     {
         bool m_isLeaf;
         Rect m_boundingBox;
+        Bounds m_bounds; // m_boundingBox for the tests, loose edges at infinity
         size_t m_count; // Number of elements in this node
-        constexpr _NodeBase(const Rect &boundingBox)
-            : m_isLeaf(true), m_boundingBox(boundingBox), m_count(0){}
+        size_t m_depth; // The root is 0
+        constexpr _NodeBase(const Rect &boundingBox, size_t depth)
+            : m_isLeaf(true), m_boundingBox(boundingBox), m_bounds(boundingBox), m_count(0), m_depth(depth){}
         constexpr bool isLeaf() const { return m_isLeaf; }
         constexpr const Rect &boundingBox() const { return m_boundingBox; }
         constexpr size_t count() const{return m_count;}
         constexpr bool contains(const PointVector &pos) const
-        {return m_boundingBox.contains(pos);}
-        constexpr bool intersects(const Rect &rect) const{return m_boundingBox.intersects(rect);}
+        {return m_bounds.contains(pos);}
+        constexpr bool intersects(const Bounds &bounds) const{return m_bounds.intersects(bounds);}
+        // Halving an edge that is infinite on one side only gives back the same box
+        bool divisible(void) const
+        {
+            const PointVector size = m_boundingBox.size();
+            const RectLooseness loose = m_boundingBox.looseness();
+            for(size_t axis = 0; axis < 2; ++axis)
+            {
+                if(size[axis] > 0.0 || (loose.looseMin(axis) && loose.looseMax(axis)))
+                    return true;
+            }
+            return false;
+        }
     };
     constexpr bool _vertexAttrs[4][2] = {
         {true, true},
@@ -56,36 +73,56 @@ namespace _qt
         _Node *m_children[4]; // NE, NW, SW, SE
         std::list<_QTData<T>> m_data;
         _Node(const Rect &boundingBox, _Node *parent)
-            : _NodeBase(boundingBox), m_parent(parent), m_data(){}
+            : _NodeBase(boundingBox, parent ? parent->m_depth + 1 : 0), m_parent(parent), m_children{}, m_data(){}
+        _Node(const _Node &) = delete;
         constexpr _Node *parent() const { return m_parent; }
         constexpr _Node *const(&children() const)[4]{ return m_children; }
     private:
         void _clearSubtree(void);
     public:
-        void divideNode(void);
+        void divideNode(size_t countLimit, size_t maxDepth);
         size_t clearSubtree(void);
     };
 
     constexpr RectLooseness _completelyLoose({{true, true}, {true, true}});
 }
 
+// Quadtree holding (position, T) pairs by value, for small T such as ids or indices; it owns no
+// objects. Leaves split above countLimit elements and fold back together at half of it.
+// Queries hand over whole leaves: the callback gets each intersecting leaf's std::list and may read,
+// change, erase or add elements and move their pos. Elements that left their leaf are put back once
+// the whole query is done, so none is seen twice.
 template<typename T>
 class EntityTree
 {
+public:
+    typedef _qt::_QTData<T> ValueType;
+    typedef std::list<ValueType> LeafData;
 private:
     typedef _qt::_Node<T> NodeType;
     NodeType m_root;
     size_t m_countLimit;
+    size_t m_maxDepth;
 public:
-    QuadTree(const Rect &boundingBox, size_t countLimit)
-        : m_root(boundingBox, nullptr), m_countLimit(countLimit){}
+    EntityTree(const Rect &boundingBox, size_t countLimit, size_t maxDepth = 16)
+        : m_root(boundingBox, nullptr), m_countLimit(countLimit ? countLimit : 1), m_maxDepth(maxDepth){}
+    EntityTree(const EntityTree &) = delete;
+    // func(LeafData &) for every leaf whose box meets searchArea; elements outside it are passed too
+    template<typename LeafQuery>
+    void queryRect(const Rect &searchArea, LeafQuery &&func)
+    {queryRect(toBounds(searchArea), std::forward<LeafQuery>(func));}
     template<typename LeafQuery>
-    void queryRect(const Rect &searchArea, LeafQuery &&func);
-    void insert(const PointVector &pos, const T &data);
+    void queryRect(const Bounds &searchArea, LeafQuery &&func);
+    // False if pos is outside the bounding box
+    bool insert(const PointVector &pos, const T &data);
+    size_t size(void) const
+    {return m_root.count();}
+    bool empty(void) const
+    {return !m_root.count();}
     void clear(void)
     {m_root.clearSubtree();}
-    ~QuadTree()
+    ~EntityTree()
     {clear();}
 };
 #include "imp/Tree.tpp"
-#endif // _TREE_HPP_
\ No newline at end of file
+#endif // _TREE_HPP_
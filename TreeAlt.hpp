@@ -31,96 +31,143 @@ public:
 };
 typedef std::shared_ptr<PositionedObject> PositionedObjectPtr;
 
+struct TreeStats
+{
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t objects = 0;
+    size_t depth = 0; // Deepest level, the root being 1
+};
+
+// Shared by every node of one tree, so it can be changed while the tree is in use.
+// A leaf splits when it would hold more than splitCapacity objects, and a subtree folds back
+// into one leaf once it holds mergeCapacity or fewer; the gap between the two keeps objects
+// that wander back and forth over a boundary from splitting and merging the same node every tick.
+struct TreeTuning
+{
+    size_t splitCapacity = 8;
+    size_t mergeCapacity = 4;
+    size_t maxDepth = 16; // Leaves this deep just keep growing
+};
+
+// Work done by one tree since the counters were last reset
+struct TreeCounters
+{
+    size_t queries = 0;
+    size_t nodesVisited = 0;
+    size_t objectsTested = 0;
+    size_t splits = 0;
+    size_t merges = 0;
+    size_t moves = 0; // Objects that left their node and were put back higher up
+
+    void reset(void)
+    {*this = TreeCounters();}
+};
+
 class QuadTreeNode
 {
 private:
-    Rect m_region;
+    struct _Shared
+    {
+        TreeTuning tuning;
+        TreeCounters counters;
+    };
+
+    Rect m_region;  // Kept for subdividing
+    Bounds m_bounds; // Same region, for the containment tests
     std::list<PositionedObjectPtr> m_objects;
     std::unique_ptr<QuadTreeNode> m_children[4]{}; // 4 quadrants
-    size_t m_capacity;
+    std::shared_ptr<_Shared> m_shared;
+    size_t m_count; // Objects in this node and everything below it
+    size_t m_depth;
     bool m_divided;
 
-public:
-    QuadTreeNode(const Rect &region, size_t capacity = 8)
-        : m_region(region), m_capacity(capacity), m_divided(false) {}
+    QuadTreeNode(const Rect &region, const std::shared_ptr<_Shared> &shared, size_t depth)
+        : m_region(region), m_bounds(region), m_shared(shared), m_count(0), m_depth(depth), m_divided(false) {}
 
-    bool insert(PositionedObjectPtr obj)
+    // Where subdivide() cuts each axis; returns false if no cut would separate anything.
+    // A closed axis is halved. Halving an edge that is infinite on one side only gives back the same
+    // region, so an open axis is cut halfway across the objects it holds instead: between the closed
+    // edge and the farthest object, or between the two outermost objects if both sides are open.
+    bool _splitPoint(PointVector &split) const
     {
-        if (!m_region.contains(obj->position())) return false;
-
-        if (m_objects.size() < m_capacity && !m_divided)
+        const auto &loose = m_region.looseness();
+        const PointVector &min = m_region.minPoint();
+        const PointVector &max = m_region.maxPoint();
+        bool any = false;
+        for (size_t axis = 0; axis < 2; ++axis)
         {
-            m_objects.push_back(obj);
-            return true;
+            double lo = loose.looseMin(axis) ? std::numeric_limits<double>::infinity() : min[axis];
+            double hi = loose.looseMax(axis) ? -std::numeric_limits<double>::infinity() : max[axis];
+            if (loose.looseMin(axis) || loose.looseMax(axis))
+            {
+                for (const auto &obj : m_objects)
+                {
+                    lo = std::min(lo, obj->position()[axis]);
+                    hi = std::max(hi, obj->position()[axis]);
+                }
+            }
+            if (lo < hi)
+            {
+                split[axis] = (lo + hi) * 0.5;
+                any = true;
+            }
+            else
+                split[axis] = m_region.center()[axis];
         }
+        return any;
+    }
 
-        if (!m_divided)
-            subdivide();
+    bool _canSplit(void) const
+    {
+        PointVector split;
+        return m_depth < m_shared->tuning.maxDepth && _splitPoint(split);
+    }
 
+    bool _pushDown(const PositionedObjectPtr &obj)
+    {
         for (auto &child : m_children)
         {
             if (child->insert(obj)) return true;
         }
-
-        return false; // Should not reach here if regions are well defined
+        return false;
     }
 
-    bool remove(PositionedObjectPtr obj)
+    // Folds the whole subtree into this node; only done once it is small
+    void _collapse()
     {
-        auto it = std::find(m_objects.begin(), m_objects.end(), obj);
-        if (it != m_objects.end())
-        {
-            m_objects.erase(it);
-            if (m_divided)
-                tryMerge();
-            return true;
-        }
-    
-        if (m_divided)
+        if (!m_divided) return;
+        for (auto &child : m_children)
         {
-            for (auto &child : m_children)
-            {
-                if (child && child->remove(obj))
-                {
-                    tryMerge();
-                    return true;
-                }
-            }
+            child->_collapse();
+            m_objects.splice(m_objects.end(), child->m_objects);
+            child.reset();
         }
-    
-        return false;
+        m_divided = false;
+        ++m_shared->counters.merges;
     }
-    
-    void tryMerge()
+
+    void _tryMerge()
     {
-        if (!m_divided) return;
-    
-        bool canMerge = true;
-        for (const auto &child : m_children)
-        {
-            if (!child || child->m_divided || !child->m_objects.empty())
-            {
-                canMerge = false;
-                break;
-            }
-        }
-    
-        if (canMerge)
-        {
-            for (auto &child : m_children)
-                child.reset();
-            m_divided = false;
-        }
+        if (m_divided && m_count <= m_shared->tuning.mergeCapacity)
+            _collapse();
     }
 
+    // Returns how many objects left this subtree. Ones that moved out of their node go into
+    // escaped, and each level puts back the ones it contains after it has queried all its children,
+    // so nothing is reported twice.
     template <typename Func>
-    void query(const Rect &area, Func &&callback)
+    size_t _query(const Bounds &area, Func &callback, std::vector<PositionedObjectPtr> &escaped)
     {
-        if (!m_region.intersects(area)) return;
+        if (!m_bounds.intersects(area)) return 0;
+        TreeCounters &counters = m_shared->counters;
+        ++counters.nodesVisited;
 
+        const size_t before = m_count;
         for (auto it = m_objects.begin(); it != m_objects.end(); )
         {
             const auto &obj = *it;
+            ++counters.objectsTested;
             if (area.contains(obj->position()))
             {
                 callback(obj);
@@ -128,14 +175,15 @@ public:
                 if (!obj->valid())
                 {
                     it = m_objects.erase(it);
+                    --m_count;
                     continue;
                 }
 
-                if (!m_region.contains(obj->position()))
+                if (!m_bounds.contains(obj->position()))
                 {
-                    auto toMove = obj;
+                    escaped.push_back(obj);
                     it = m_objects.erase(it);
-                    insert(toMove); // try to reinsert; may fail upward
+                    --m_count;
                     continue;
                 }
             }
@@ -144,37 +192,183 @@ public:
 
         if (m_divided)
         {
+            const size_t ownEscaped = escaped.size();
             for (const auto &child : m_children)
-                child->query(area, callback);
+                m_count -= child->_query(area, callback, escaped);
+            for (size_t i = ownEscaped; i < escaped.size(); )
+            {
+                if (insert(escaped[i]))
+                {
+                    ++counters.moves;
+                    escaped[i] = std::move(escaped.back());
+                    escaped.pop_back();
+                }
+                else
+                    ++i;
+            }
+            _tryMerge();
         }
+        return before - m_count;
     }
 
-    void subdivide()
+public:
+    QuadTreeNode(const Rect &region, size_t capacity = 8)
+        : QuadTreeNode(region, std::make_shared<_Shared>(), 1)
     {
-        PointVector c = m_region.center();
-        const PointVector &min = m_region.minPoint();
-        const PointVector &max = m_region.maxPoint();
+        m_shared->tuning.splitCapacity = capacity;
+        m_shared->tuning.mergeCapacity = capacity / 2;
+    }
+    QuadTreeNode(const Rect &region, const TreeTuning &tuning)
+        : QuadTreeNode(region, std::make_shared<_Shared>(), 1)
+    {m_shared->tuning = tuning;}
 
+    // Changes take effect as nodes next split or merge, or all at once with retune()
+    TreeTuning &tuning()
+    {return m_shared->tuning;}
+    const TreeTuning &tuning() const
+    {return m_shared->tuning;}
+    TreeCounters &counters()
+    {return m_shared->counters;}
+    const TreeCounters &counters() const
+    {return m_shared->counters;}
+    size_t size() const
+    {return m_count;}
+
+    bool insert(PositionedObjectPtr obj)
+    {
+        if (!m_bounds.contains(obj->position())) return false;
+
+        if (!m_divided && (m_objects.size() < m_shared->tuning.splitCapacity || !_canSplit()))
+        {
+            m_objects.push_back(obj);
+            ++m_count;
+            return true;
+        }
+
+        if (!m_divided)
+            subdivide();
+
+        if (!_pushDown(obj))
+            m_objects.push_back(obj); // Should not happen if regions are well defined, but never lose it
+        ++m_count;
+        return true;
+    }
+
+    bool remove(PositionedObjectPtr obj)
+    {
+        auto it = std::find(m_objects.begin(), m_objects.end(), obj);
+        if (it != m_objects.end())
+        {
+            m_objects.erase(it);
+            --m_count;
+            _tryMerge();
+            return true;
+        }
+    
+        if (m_divided)
+        {
+            for (auto &child : m_children)
+            {
+                if (child && child->remove(obj))
+                {
+                    --m_count;
+                    _tryMerge();
+                    return true;
+                }
+            }
+        }
+    
+        return false;
+    }
+
+    template <typename Func>
+    void query(const Rect &area, Func &&callback)
+    {query(toBounds(area), callback);}
+
+    template <typename Func>
+    void query(const Bounds &area, Func &&callback)
+    {
+        ++m_shared->counters.queries;
+        std::vector<PositionedObjectPtr> escaped;
+        _query(area, callback, escaped);
+        for (auto &obj : escaped)
+            insert(obj); // Outside the whole tree now; only a bounded root can refuse these
+    }
+
+    void subdivide()
+    {
+        PointVector c;
+        _splitPoint(c);
         const auto &loose = m_region.looseness();
+        // An open edge has no coordinate of its own; the cut stands in for it so every quadrant stays ordered
+        const PointVector min(loose.looseMin(0) ? c[0] : m_region.minPoint()[0], loose.looseMin(1) ? c[1] : m_region.minPoint()[1]);
+        const PointVector max(loose.looseMax(0) ? c[0] : m_region.maxPoint()[0], loose.looseMax(1) ? c[1] : m_region.maxPoint()[1]);
 
         // Define each child quadrant
-        m_children[0] = std::make_unique<QuadTreeNode>(Rect(min, c, Rect::Looseness({
+        m_children[0].reset(new QuadTreeNode(Rect(min, c, Rect::Looseness({
             {loose.looseMin(0), false},
-            {loose.looseMin(1), false}})), m_capacity);
+            {loose.looseMin(1), false}})), m_shared, m_depth + 1));
 
-        m_children[1] = std::make_unique<QuadTreeNode>(Rect({c[0], min[1]}, {max[0], c[1]}, Rect::Looseness({
+        m_children[1].reset(new QuadTreeNode(Rect({c[0], min[1]}, {max[0], c[1]}, Rect::Looseness({
             {false, loose.looseMax(0)},
-            {loose.looseMin(1), false}})), m_capacity);
+            {loose.looseMin(1), false}})), m_shared, m_depth + 1));
 
-        m_children[2] = std::make_unique<QuadTreeNode>(Rect({min[0], c[1]}, {c[0], max[1]}, Rect::Looseness({
+        m_children[2].reset(new QuadTreeNode(Rect({min[0], c[1]}, {c[0], max[1]}, Rect::Looseness({
             {loose.looseMin(0), false},
-            {false, loose.looseMax(1)}})), m_capacity);
+            {false, loose.looseMax(1)}})), m_shared, m_depth + 1));
 
-        m_children[3] = std::make_unique<QuadTreeNode>(Rect(c, max, Rect::Looseness({
+        m_children[3].reset(new QuadTreeNode(Rect(c, max, Rect::Looseness({
             {false, loose.looseMax(0)},
-            {false, loose.looseMax(1)}})), m_capacity);
+            {false, loose.looseMax(1)}})), m_shared, m_depth + 1));
 
         m_divided = true;
+        ++m_shared->counters.splits;
+
+        // Hand what we held down to the quadrants, so only the leaves hold objects
+        for (auto it = m_objects.begin(); it != m_objects.end(); )
+        {
+            if (_pushDown(*it))
+                it = m_objects.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // Reshapes the whole tree for the current tuning at once, instead of as objects come and go
+    void retune()
+    {
+        if (m_divided)
+        {
+            if (m_count <= m_shared->tuning.mergeCapacity)
+            {
+                _collapse();
+                return;
+            }
+            for (auto &child : m_children)
+                child->retune();
+            return;
+        }
+        if (m_objects.size() > m_shared->tuning.splitCapacity && _canSplit())
+        {
+            subdivide();
+            for (auto &child : m_children)
+                child->retune();
+        }
+    }
+
+    void collectStats(TreeStats &stats, size_t depth = 1) const
+    {
+        ++stats.nodes;
+        stats.objects += m_objects.size();
+        if (depth > stats.depth)
+            stats.depth = depth;
+        if (!m_divided)
+        {
+            ++stats.leaves;
+            return;
+        }
+        for (const auto &child : m_children)
+            child->collectStats(stats, depth + 1);
     }
 
     void clear()
@@ -186,6 +380,55 @@ public:
             child.reset();
         }
         m_divided = false;
+        m_count = 0;
+    }
+};
+
+// Moves a tree's capacity towards where queries and upkeep cost about the same.
+// Work is counted rather than timed, so a tick that was slow for other reasons does not steer it.
+// Call tick() once per game tick; it decides once every window ticks.
+class TreeTuner
+{
+public:
+    static constexpr size_t nodeCost = 4;    // Visiting a node, in object tests
+    static constexpr size_t moveCost = 8;    // Putting an object back a few levels up
+    static constexpr size_t reshapeCost = 64; // Four node allocations, plus the objects moved
+private:
+    size_t m_window;
+    size_t m_minCapacity;
+    size_t m_maxCapacity;
+    size_t m_ticks;
+public:
+    TreeTuner(size_t window = 30, size_t minCapacity = 2, size_t maxCapacity = 64)
+        : m_window(window), m_minCapacity(minCapacity), m_maxCapacity(maxCapacity), m_ticks(0) {}
+
+    // Returns true if it changed the capacity
+    bool tick(QuadTreeNode &tree)
+    {
+        if (++m_ticks < m_window) return false;
+        m_ticks = 0;
+        TreeCounters &c = tree.counters();
+        TreeTuning &t = tree.tuning();
+        const size_t queryCost = c.objectsTested + c.nodesVisited * nodeCost;
+        const size_t upkeep = (c.splits + c.merges) * (reshapeCost + t.splitCapacity) + c.moves * moveCost;
+        const size_t step = (t.splitCapacity / 4 > 1) ? t.splitCapacity / 4 : 1;
+        size_t capacity = t.splitCapacity;
+        // Reshaping dominates: bigger leaves split and merge less often
+        if (upkeep * 2 > queryCost && capacity < m_maxCapacity)
+            capacity = std::min(capacity + step, m_maxCapacity);
+        // Queries dominate and the nodes they visit are well filled: smaller leaves mean fewer tests
+        else if (upkeep * 8 < queryCost && c.nodesVisited && c.objectsTested / c.nodesVisited > capacity / 2
+            && capacity > m_minCapacity)
+            capacity = std::max(capacity - step, m_minCapacity);
+        bool changed = capacity != t.splitCapacity;
+        if (changed)
+        {
+            t.splitCapacity = capacity;
+            t.mergeCapacity = capacity / 2;
+            tree.retune();
+        }
+        c.reset(); // Including what retune() did, or the next window would undo it
+        return changed;
     }
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,210 @@
+// Benchmark of the two spatial containers on the same workload: EntityTree<uint32_t> holding ids by
+// value, against QuadTreeNode holding shared PositionedObjects.
+// Every tick moves every object a little and then runs some view-sized queries, the way a room does.
+//
+// Usage: TreeBench [-n objects] [-t ticks] [-q queriesPerTick] [-c capacity] [-w worldSize] [-v viewSize]
+//                  [-s speed] [-r seed]
+//
+// Exits with 1 if the two containers do not find the same objects.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <memory>
+#include <random>
+#include <vector>
+#include "SteadyTimer.hpp"
+#include "Tree.hpp"
+#include "TreeAlt.hpp"
+
+struct TreeBenchConfig
+{
+    size_t objects = 20000;
+    size_t ticks = 300;
+    size_t queries = 16;
+    size_t capacity = 8;
+    double world = 4000.0;
+    double view = 400.0;
+    double speed = 2.0; // Per tick, on each axis
+    uint32_t seed = 1;
+};
+
+struct TreeBenchResult
+{
+    double insert = 0.0;
+    double move = 0.0;
+    double query = 0.0;
+    size_t found = 0; // Has to be the same for both
+};
+
+// Positions and velocities both containers follow, so they see the same moves
+struct TreeBenchWorld
+{
+    std::vector<PointVector> pos;
+    std::vector<PointVector> vel;
+    std::vector<PointVector> views; // Query corners, per tick
+    double half;
+
+    TreeBenchWorld(const TreeBenchConfig &config)
+        : half(config.world * 0.5)
+    {
+        std::mt19937 rng(config.seed);
+        std::uniform_real_distribution<double> place(-half, half), dir(-config.speed, config.speed);
+        std::uniform_real_distribution<double> corner(-half, half - config.view);
+        for(size_t i = 0; i < config.objects; ++i)
+        {
+            pos.emplace_back(place(rng), place(rng));
+            vel.emplace_back(dir(rng), dir(rng));
+        }
+        for(size_t i = 0; i < config.ticks * config.queries; ++i)
+            views.emplace_back(corner(rng), corner(rng));
+    }
+    // Bounces off the walls, so nothing leaves the tree
+    PointVector step(size_t i)
+    {
+        PointVector next = pos[i] + vel[i];
+        for(size_t axis = 0; axis < 2; ++axis) if(next[axis] < -half || next[axis] > half)
+        {
+            PointVector flip(axis ? 1.0 : -1.0, axis ? -1.0 : 1.0);
+            vel[i] = PointVector(vel[i][0] * flip[0], vel[i][1] * flip[1]);
+            next = pos[i] + vel[i];
+        }
+        return pos[i] = next;
+    }
+};
+
+class BenchObject : public PositionedObject
+{
+public:
+    uint32_t id;
+    BenchObject(const PointVector &pos, uint32_t id)
+        : PositionedObject(pos), id(id){}
+};
+
+TreeBenchResult benchEntityTree(const TreeBenchConfig &config)
+{
+    TreeBenchWorld world(config);
+    TreeBenchResult result;
+    SteadyTimer timer;
+    Rect region({-world.half, -world.half}, {world.half, world.half});
+    EntityTree<uint32_t> tree(region, config.capacity);
+    const Rect everything({0.0, 0.0}, {0.0, 0.0}, completelyLoose);
+
+    double start = timer();
+    for(uint32_t i = 0; i < world.pos.size(); ++i)
+        tree.insert(world.pos[i], i);
+    result.insert = timer() - start;
+
+    for(size_t tick = 0; tick < config.ticks; ++tick)
+    {
+        // Moving goes through the leaf callback; whatever left its leaf is reinserted afterwards
+        start = timer();
+        tree.queryRect(everything, [&](EntityTree<uint32_t>::LeafData &leaf){
+            for(auto &elem : leaf)
+                elem.pos = world.step(elem.data);
+        });
+        result.move += timer() - start;
+
+        start = timer();
+        for(size_t q = 0; q < config.queries; ++q)
+        {
+            const PointVector &min = world.views[tick * config.queries + q];
+            Rect view(min, min + PointVector(config.view, config.view));
+            tree.queryRect(view, [&](EntityTree<uint32_t>::LeafData &leaf){
+                for(const auto &elem : leaf) if(view.contains(elem.pos))
+                    ++result.found;
+            });
+        }
+        result.query += timer() - start;
+    }
+    return result;
+}
+
+TreeBenchResult benchQuadTreeNode(const TreeBenchConfig &config)
+{
+    TreeBenchWorld world(config);
+    TreeBenchResult result;
+    SteadyTimer timer;
+    Rect region({-world.half, -world.half}, {world.half, world.half});
+    QuadTreeNode tree(region, config.capacity);
+    const Rect everything({0.0, 0.0}, {0.0, 0.0}, completelyLoose);
+
+    double start = timer();
+    for(uint32_t i = 0; i < world.pos.size(); ++i)
+        tree.insert(std::make_shared<BenchObject>(world.pos[i], i));
+    result.insert = timer() - start;
+
+    for(size_t tick = 0; tick < config.ticks; ++tick)
+    {
+        start = timer();
+        tree.query(everything, [&](const PositionedObjectPtr &obj){
+            obj->setPosition(world.step(static_cast<BenchObject &>(*obj).id));
+        });
+        result.move += timer() - start;
+
+        start = timer();
+        for(size_t q = 0; q < config.queries; ++q)
+        {
+            const PointVector &min = world.views[tick * config.queries + q];
+            Rect view(min, min + PointVector(config.view, config.view));
+            tree.query(view, [&](const PositionedObjectPtr &){
+                ++result.found;
+            });
+        }
+        result.query += timer() - start;
+    }
+    return result;
+}
+
+void printResult(const char *name, const TreeBenchConfig &config, const TreeBenchResult &result)
+{
+    printf("%-14s insert %8.2f ms   move %8.3f ms/tick   query %8.2f us/query   found %zu\n", name,
+        result.insert * 1e3, result.move * 1e3 / config.ticks, result.query * 1e6 / (config.ticks * config.queries),
+        result.found);
+}
+
+int main(int argc, char **argv)
+{
+    TreeBenchConfig config;
+    for(int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if(!value)
+        {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 1;
+        }
+        ++i;
+        if(!strcmp(arg, "-n")) config.objects = strtoul(value, nullptr, 10);
+        else if(!strcmp(arg, "-t")) config.ticks = strtoul(value, nullptr, 10);
+        else if(!strcmp(arg, "-q")) config.queries = strtoul(value, nullptr, 10);
+        else if(!strcmp(arg, "-c")) config.capacity = strtoul(value, nullptr, 10);
+        else if(!strcmp(arg, "-w")) config.world = atof(value);
+        else if(!strcmp(arg, "-v")) config.view = atof(value);
+        else if(!strcmp(arg, "-s")) config.speed = atof(value);
+        else if(!strcmp(arg, "-r")) config.seed = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+    if(!config.ticks || !config.queries)
+    {
+        fprintf(stderr, "Need at least one tick and one query per tick\n");
+        return 1;
+    }
+    printf("%zu objects, %zu ticks, %zu queries of %.0f x %.0f per tick, capacity %zu, world %.0f\n",
+        config.objects, config.ticks, config.queries, config.view, config.view, config.capacity, config.world);
+    TreeBenchResult entityTree = benchEntityTree(config), quadTree = benchQuadTreeNode(config);
+    printResult("EntityTree", config, entityTree);
+    printResult("QuadTreeNode", config, quadTree);
+    // Same moves and views, so any difference means one of them lost or duplicated an object
+    if(entityTree.found != quadTree.found)
+    {
+        fprintf(stderr, "Mismatch: EntityTree found %zu objects, QuadTreeNode %zu\n", entityTree.found, quadTree.found);
+        return 1;
+    }
+    return 0;
+}
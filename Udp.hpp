@@ -0,0 +1,677 @@
+#ifndef _UDP_HPP_
+#define _UDP_HPP_
+
+#include <atomic>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "NetBase.hpp"
+#include "LockFree.hpp"
+#include "Wire.hpp"
+#include "Profiler.hpp"
+
+// Optional UDP transport.
+// Every packet starts with the same header: our sequence number, the newest sequence we have seen
+// from the peer plus a 32 bit history (so acks ride on whatever we send anyway), and the reliable
+// messages the peer has not acknowledged yet. The history tells the sender which of its packets
+// arrived even when the packets carrying their acks were lost. Snapshots are unreliable and simply superseded; input
+// packets repeat the last few commands so a single lost packet does not lose a key press.
+//
+//  header:   u16 protocol, u8 type, u8 reliableCount, u16 seq, u16 ack, u32 ackBits, u16 reliableAck
+//  reliable: reliableCount x {u16 id, u8 len, len bytes}
+//  input:    u8 count, count x {u16 cmdSeq, u8 op, f64 arg0, f64 arg1}
+//  snapshot: the rest of the datagram is one encoded snapshot
+
+namespace _udp
+{
+    static constexpr uint16_t _protocol = 0x5A34; // "Z4"
+    static constexpr size_t _headerSize = 14;
+    static constexpr size_t _maxDatagram = 65507;
+
+    constexpr bool _isNewer(uint16_t a, uint16_t b)
+    {return static_cast<int16_t>(static_cast<uint16_t>(a - b)) > 0;}
+
+    inline uint64_t _addrKey(const sockaddr_in &addr)
+    {return (static_cast<uint64_t>(addr.sin_addr.s_addr) << 16) | addr.sin_port;}
+}
+
+// Drops and duplicates outgoing datagrams, so the whole protocol can be exercised over loopback.
+class LossSimulator
+{
+private:
+    double m_lossRate;
+    double m_duplicateRate;
+    std::mt19937 m_rng;
+    std::uniform_real_distribution<double> m_dist;
+public:
+    LossSimulator(double lossRate = 0.0, double duplicateRate = 0.0, uint32_t seed = 1)
+        : m_lossRate(lossRate), m_duplicateRate(duplicateRate), m_rng(seed), m_dist(0.0, 1.0){}
+    void configure(double lossRate, double duplicateRate)
+    {
+        m_lossRate = lossRate;
+        m_duplicateRate = duplicateRate;
+    }
+    // How many copies of the next datagram actually go out: 0, 1 or 2.
+    int copies(void)
+    {
+        if(m_lossRate > 0.0 && m_dist(m_rng) < m_lossRate)
+            return 0;
+        if(m_duplicateRate > 0.0 && m_dist(m_rng) < m_duplicateRate)
+            return 2;
+        return 1;
+    }
+    void sendTo(SocketT sockFd, const std::string &packet, const sockaddr_in &addr)
+    {
+        for(int i = copies(); i > 0; --i)
+            sendto(sockFd, packet.data(), static_cast<int>(packet.size()), 0, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    }
+};
+
+// Sequence/ack bookkeeping and the reliable message channel for one side of one connection.
+class UdpChannel
+{
+public:
+    enum class Type : uint8_t
+    {
+        hello,
+        input,
+        snapshot,
+        reliableOnly
+    };
+    static constexpr size_t maxReliablePerPacket = 8;
+    static constexpr size_t maxReliableQueued = 64;
+    static constexpr size_t maxReliableSize = 255;
+    static constexpr size_t sendHistory = 64;
+private:
+    uint16_t m_localSeq;
+    uint16_t m_remoteSeq;
+    uint32_t m_remoteBits; // Bit i set: m_remoteSeq - 1 - i was received as well
+    bool m_hasRemote;
+    uint16_t m_reliableOutNext;
+    std::deque<std::pair<uint16_t, std::string>> m_reliableOut; // Sent but not acknowledged, oldest first
+    uint16_t m_reliableInNext;
+    uint16_t m_sentSeqs[sendHistory];
+    double m_sentTimes[sendHistory];
+    bool m_sentAcked[sendHistory];
+    std::vector<uint16_t> m_acked; // Our sequences the last receive() confirmed for the first time
+    double m_rtt;
+    size_t m_reliableDropped;
+
+    // First ack of one of our packets still in the send history; only the newest one gives an RTT
+    // sample, an older one may just have had its earlier acks lost
+    void _acknowledge(uint16_t seq, double now, bool sample)
+    {
+        const size_t slot = seq % sendHistory;
+        if(m_sentSeqs[slot] != seq || m_sentAcked[slot])
+            return;
+        m_sentAcked[slot] = true;
+        m_acked.push_back(seq);
+        if(sample)
+        {
+            double rtt = now - m_sentTimes[slot];
+            m_rtt = (m_rtt == 0.0) ? rtt : m_rtt * 0.875 + rtt * 0.125;
+        }
+    }
+public:
+    UdpChannel()
+        : m_localSeq(0), m_remoteSeq(0), m_remoteBits(0), m_hasRemote(false), m_reliableOutNext(0),
+          m_reliableInNext(0), m_sentSeqs(), m_sentTimes(), m_rtt(0.0), m_reliableDropped(0)
+    {
+        for(bool &acked : m_sentAcked)
+            acked = true; // Nothing sent yet
+    }
+
+    double rtt(void) const
+    {return m_rtt;}
+    uint16_t remoteSeq(void) const
+    {return m_remoteSeq;}
+    size_t reliablePending(void) const
+    {return m_reliableOut.size();}
+    size_t reliableDropped(void) const
+    {return m_reliableDropped;}
+    // Sequence the next begin() stamps on its packet
+    uint16_t localSeq(void) const
+    {return m_localSeq;}
+    // Our packets the peer confirmed in the last receive(), from ack and ackBits, each reported once.
+    // Packets older than sendHistory are never reported.
+    const std::vector<uint16_t> &acked(void) const
+    {return m_acked;}
+
+    bool sendReliable(const std::string &msg)
+    {
+        if(msg.size() > maxReliableSize || m_reliableOut.size() >= maxReliableQueued)
+        {
+            ++m_reliableDropped;
+            return false;
+        }
+        m_reliableOut.emplace_back(m_reliableOutNext++, msg);
+        return true;
+    }
+
+    // Starts a packet: header plus every reliable message still in flight.
+    void begin(std::string &packet, Type type, double now)
+    {
+        using namespace _udp;
+        using namespace _wire;
+        packet.clear();
+        size_t reliableCount = (m_reliableOut.size() < maxReliablePerPacket) ? m_reliableOut.size() : maxReliablePerPacket;
+        _put16(packet, _protocol);
+        _put8(packet, static_cast<uint8_t>(type));
+        _put8(packet, static_cast<uint8_t>(reliableCount));
+        _put16(packet, m_localSeq);
+        _put16(packet, m_remoteSeq);
+        _put32(packet, m_hasRemote ? m_remoteBits : 0);
+        _put16(packet, m_reliableInNext);
+        for(size_t i = 0; i < reliableCount; ++i)
+        {
+            const auto &msg = m_reliableOut[i];
+            _put16(packet, msg.first);
+            _put8(packet, static_cast<uint8_t>(msg.second.size()));
+            packet += msg.second;
+        }
+        m_sentSeqs[m_localSeq % sendHistory] = m_localSeq;
+        m_sentTimes[m_localSeq % sendHistory] = now;
+        m_sentAcked[m_localSeq % sendHistory] = false;
+        ++m_localSeq;
+    }
+
+    // Consumes the header of a received packet. Returns false for garbage and duplicates.
+    // newest is set when this packet is newer than every packet received before it.
+    bool receive(_wire::_Reader &rd, Type &type, std::vector<std::string> &reliable, bool &newest, double now)
+    {
+        using namespace _udp;
+        using namespace _wire;
+        m_acked.clear();
+        if(rd.get16() != _protocol)
+            return false;
+        type = static_cast<Type>(rd.get8());
+        size_t reliableCount = rd.get8();
+        uint16_t seq = rd.get16();
+        uint16_t ack = rd.get16();
+        uint32_t ackBits = rd.get32();
+        uint16_t reliableAck = rd.get16();
+        if(!rd.ok)
+            return false;
+
+        newest = !m_hasRemote || _isNewer(seq, m_remoteSeq);
+        if(newest)
+        {
+            uint16_t shift = static_cast<uint16_t>(seq - m_remoteSeq);
+            m_remoteBits = m_hasRemote ? ((shift > 32) ? 0 : ((m_remoteBits << 1) | 1u) << (shift - 1)) : 0;
+            m_remoteSeq = seq;
+            m_hasRemote = true;
+        }
+        else
+        {
+            uint16_t back = static_cast<uint16_t>(m_remoteSeq - seq);
+            if(back == 0 || back > 32 || (m_remoteBits & (1u << (back - 1))))
+                return false; // Duplicate, or too old to tell
+            m_remoteBits |= 1u << (back - 1);
+        }
+
+        _acknowledge(ack, now, true);
+        for(uint16_t i = 0; i < 32; ++i) if(ackBits & (1u << i))
+            _acknowledge(static_cast<uint16_t>(ack - 1 - i), now, false);
+        while(!m_reliableOut.empty() && _isNewer(reliableAck, m_reliableOut.front().first))
+            m_reliableOut.pop_front();
+
+        for(size_t i = 0; i < reliableCount; ++i)
+        {
+            uint16_t id = rd.get16();
+            size_t len = rd.get8();
+            const char *bytes = rd.bytes(len);
+            if(!rd.ok)
+                return false;
+            if(id == m_reliableInNext)
+            {
+                reliable.emplace_back(bytes, len);
+                ++m_reliableInNext;
+            }
+        }
+        return true;
+    }
+};
+
+// Server side of the UDP transport. Plays the same role as a NetThread: one thread, one socket,
+// NetCommands into the shared inbound queue and NetOutputs out of its own MPSC queue, which every room shard pushes to.
+class UdpThread
+{
+public:
+    struct Config
+    {
+        uint16_t port = 1024;
+        double lossRate = 0.0;      // Outgoing datagrams dropped on purpose
+        double duplicateRate = 0.0; // Outgoing datagrams sent twice on purpose
+        uint32_t seed = 1;
+        double peerTimeout = 5.0;   // Seconds without any packet before a peer counts as gone
+        double closeLinger = 1.0;   // Seconds we keep resending "bye" to a closed peer
+    };
+    static constexpr size_t outboundCapacity = 1024;
+    static constexpr size_t pendingLimit = 256;
+    static constexpr int pollTimeoutMs = 1;
+    static constexpr double resendInterval = 0.05;
+    typedef MpscQueue<NetCommand, 8192> InboundQueue;
+    typedef MpscQueue<NetOutput, outboundCapacity> OutboundQueue; // Every room shard may send
+private:
+    struct Peer
+    {
+        sockaddr_in addr;
+        uint32_t connId;
+        UdpChannel channel;
+        uint16_t lastCmdSeq;
+        uint32_t cmdCount; // lastCmdSeq + 1, without the wrap
+        bool hasCmd;
+        double lastHeard;
+        double lastSend;
+        bool closing;
+        double closeTime;
+        std::deque<NetCommand> pending;
+        std::unique_ptr<CompactSnapshotEncoder> compact;
+        uint32_t frames[UdpChannel::sendHistory]; // Compact frame in each recent packet, by seq; 0 for none
+    };
+
+    Config m_config;
+    uint32_t m_index;
+    uint32_t m_connIdShift;
+    uint32_t m_nextSlot;
+    SocketT m_sockFd;
+    InboundQueue &m_inbound;
+    OutboundQueue m_outbound;
+    LossSimulator m_loss;
+    std::unordered_map<uint64_t, Peer> m_peers;
+    std::unordered_map<uint32_t, uint64_t> m_byConnId;
+    std::string m_packet;
+    std::string m_payload;
+    std::vector<std::string> m_reliable;
+    std::atomic<size_t> m_oversized;
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    void _run(void);
+    void _command(Peer &peer, const NetCommand &cmd)
+    {
+        if(cmd.op == 'F') // Compact payloads start with their own magic byte, no switch marker needed
+        {
+            SnapshotEncoding encoding = compactEncodingFor(cmd);
+            encoding.reliable = false; // Frames become baselines once the ack history says they arrived
+            peer.compact.reset(new CompactSnapshotEncoder(encoding));
+        }
+        else
+            peer.pending.push_back(cmd);
+    }
+    void _receive(const uint8_t *data, size_t len, const sockaddr_in &from, double now);
+    void _drainOutbound(double now);
+    void _sendPacket(Peer &peer, UdpChannel::Type type, const std::string &body, double now, uint32_t frame = 0)
+    {
+        peer.frames[peer.channel.localSeq() % UdpChannel::sendHistory] = frame;
+        peer.channel.begin(m_packet, type, now);
+        if(m_packet.size() + body.size() > _udp::_maxDatagram)
+        {
+            m_oversized.fetch_add(1, std::memory_order_relaxed);
+            return; // The client keeps showing its previous snapshot
+        }
+        m_packet += body;
+        m_loss.sendTo(m_sockFd, m_packet, peer.addr);
+        peer.lastSend = now;
+    }
+public:
+    UdpThread(const Config &config, uint32_t index, uint32_t connIdShift, InboundQueue &inbound)
+        : m_config(config), m_index(index), m_connIdShift(connIdShift), m_nextSlot(0), m_sockFd(INVALID_SOCKET),
+          m_inbound(inbound), m_loss(config.lossRate, config.duplicateRate, config.seed), m_oversized(0), m_running(false){}
+    UdpThread(const UdpThread &) = delete;
+    ~UdpThread()
+    {stop();}
+
+    size_t oversized(void) const
+    {return m_oversized.load(std::memory_order_relaxed);}
+    bool send(NetOutput &&out)
+    {return m_outbound.tryPush(std::move(out));}
+
+    bool start(void)
+    {
+        m_sockFd = socket(AF_INET, SOCK_DGRAM, 0);
+        if(m_sockFd == INVALID_SOCKET)
+            return false;
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(m_config.port);
+        if(bind(m_sockFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || !setNonBlocking(m_sockFd))
+        {
+            closesocket(m_sockFd);
+            m_sockFd = INVALID_SOCKET;
+            return false;
+        }
+        m_running.store(true, std::memory_order_release);
+        m_thread = std::thread(&UdpThread::_run, this);
+        return true;
+    }
+    void stop(void)
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+        if(m_sockFd != INVALID_SOCKET)
+            closesocket(m_sockFd);
+        m_sockFd = INVALID_SOCKET;
+    }
+};
+
+inline void UdpThread::_receive(const uint8_t *data, size_t len, const sockaddr_in &from, double now)
+{
+    uint64_t key = _udp::_addrKey(from);
+    auto found = m_peers.find(key);
+    if(found == m_peers.end())
+    {
+        // Only a hello may open a connection; anything else from a stranger is stale traffic.
+        if(len < _udp::_headerSize || data[2] != static_cast<uint8_t>(UdpChannel::Type::hello))
+            return;
+        Peer peer;
+        peer.addr = from;
+        peer.connId = (m_index << m_connIdShift) | (m_nextSlot++ & ((1u << m_connIdShift) - 1));
+        for(uint32_t &frame : peer.frames)
+            frame = 0;
+        peer.lastCmdSeq = 0;
+        peer.cmdCount = 0;
+        peer.hasCmd = false;
+        peer.lastHeard = now;
+        peer.lastSend = 0.0;
+        peer.closing = false;
+        peer.closeTime = 0.0;
+        NetCommand cmd;
+        cmd.connId = peer.connId;
+        cmd.kind = NetCommand::Kind::connected;
+        peer.pending.push_back(cmd);
+        m_byConnId[peer.connId] = key;
+        found = m_peers.emplace(key, std::move(peer)).first;
+    }
+    Peer &peer = found->second;
+
+    _wire::_Reader rd = {data, len, 0, true};
+    UdpChannel::Type type;
+    bool newest;
+    m_reliable.clear();
+    if(!peer.channel.receive(rd, type, m_reliable, newest, now))
+        return;
+    peer.lastHeard = now;
+    if(peer.compact)
+        for(uint16_t seq : peer.channel.acked())
+            peer.compact->acknowledge(peer.frames[seq % UdpChannel::sendHistory]);
+    for(const std::string &msg : m_reliable)
+    {
+        NetCommand cmd;
+        cmd.connId = peer.connId;
+        if(decodeCommand(msg.c_str(), cmd))
+            _command(peer, cmd);
+    }
+    if(type != UdpChannel::Type::input || peer.closing)
+        return;
+    size_t count = rd.get8();
+    for(size_t i = 0; i < count && rd.ok; ++i)
+    {
+        NetCommand cmd;
+        cmd.connId = peer.connId;
+        cmd.kind = NetCommand::Kind::input;
+        uint16_t cmdSeq = rd.get16();
+        cmd.op = static_cast<char>(rd.get8());
+        cmd.args[0] = rd.getDouble();
+        cmd.args[1] = rd.getDouble();
+        if(!rd.ok)
+            break;
+        // Redundant copies of commands we already have are skipped here.
+        if(peer.hasCmd && !_udp::_isNewer(cmdSeq, peer.lastCmdSeq))
+            continue;
+        // Echoed back as the input count, so commands lost for good do not shift the client's matching
+        peer.cmdCount = peer.hasCmd ? peer.cmdCount + static_cast<uint16_t>(cmdSeq - peer.lastCmdSeq) : cmdSeq + 1u;
+        cmd.seq = peer.cmdCount;
+        peer.lastCmdSeq = cmdSeq;
+        peer.hasCmd = true;
+        if(peer.pending.size() < pendingLimit)
+            _command(peer, cmd);
+    }
+}
+
+inline void UdpThread::_drainOutbound(double now)
+{
+    NetOutput out;
+    while(m_outbound.tryPop(out))
+    {
+        auto key = m_byConnId.find(out.connId);
+        if(key == m_byConnId.end())
+            continue;
+        Peer &peer = m_peers[key->second];
+        switch(out.kind)
+        {
+        case NetOutput::Kind::snapshot:
+            if(out.snapshot && !peer.closing)
+            {
+                PROFILE_ZONE(ProfileZoneId::snapshotEncode);
+                m_payload.clear();
+                uint32_t frame = 0;
+                if(peer.compact)
+                {
+                    peer.compact->encode(*out.snapshot, m_payload);
+                    frame = peer.compact->lastFrame();
+                }
+                else
+                    encodeSnapshotJson(*out.snapshot, m_payload);
+                _sendPacket(peer, UdpChannel::Type::snapshot, m_payload, now, frame);
+            }
+            break;
+        case NetOutput::Kind::event:
+            peer.channel.sendReliable(out.event);
+            break;
+        case NetOutput::Kind::close:
+            if(!peer.closing)
+            {
+                peer.channel.sendReliable("bye");
+                peer.closing = true;
+                peer.closeTime = now;
+            }
+            break;
+        }
+        out.snapshot.reset();
+    }
+}
+
+inline void UdpThread::_run(void)
+{
+    static const std::string emptyBody;
+    std::vector<uint8_t> buf(_udp::_maxDatagram);
+    while(m_running.load(std::memory_order_acquire))
+    {
+        double now = netNow();
+        _drainOutbound(now);
+
+        pollfd pfd = {m_sockFd, POLLIN, 0};
+        if(poll(&pfd, 1, pollTimeoutMs) > 0)
+        {
+            for(;;)
+            {
+                sockaddr_in from;
+                SockLenT fromLen = sizeof(from);
+                int len = recvfrom(m_sockFd, reinterpret_cast<char *>(buf.data()), static_cast<int>(buf.size()), 0,
+                    reinterpret_cast<sockaddr *>(&from), &fromLen);
+                if(len <= 0)
+                    break;
+                _receive(buf.data(), len, from, now);
+            }
+        }
+
+        for(auto i = m_peers.begin(); i != m_peers.end();)
+        {
+            Peer &peer = i->second;
+            while(!peer.pending.empty() && m_inbound.tryPush(peer.pending.front()))
+                peer.pending.pop_front();
+            // A closing peer gets no snapshots, so its "bye" has to travel on its own.
+            if(peer.closing && peer.channel.reliablePending() && now - peer.lastSend >= resendInterval)
+                _sendPacket(peer, UdpChannel::Type::reliableOnly, emptyBody, now);
+            bool gone = (peer.closing && (!peer.channel.reliablePending() || now - peer.closeTime > m_config.closeLinger)) ||
+                now - peer.lastHeard > m_config.peerTimeout;
+            if(gone && peer.pending.empty())
+            {
+                NetCommand cmd;
+                cmd.connId = peer.connId;
+                cmd.kind = NetCommand::Kind::disconnected;
+                if(m_inbound.tryPush(cmd))
+                {
+                    m_byConnId.erase(peer.connId);
+                    i = m_peers.erase(i);
+                    continue;
+                }
+            }
+            ++i;
+        }
+    }
+}
+
+// Client side of the UDP transport, without a thread of its own: call pump() regularly.
+// Used by tools that want to talk to the server over UDP from native code.
+class UdpClient
+{
+public:
+    static constexpr double helloInterval = 0.25;
+    static constexpr double keepAliveInterval = 0.05;
+    static constexpr size_t maxCommandsPerPacket = 32;
+    static constexpr size_t maxSnapshotsQueued = 64;
+private:
+    struct _Command
+    {
+        uint16_t seq;
+        char op;
+        double args[2];
+    };
+
+    SocketT m_sockFd;
+    sockaddr_in m_server;
+    UdpChannel m_channel;
+    LossSimulator m_loss;
+    size_t m_redundancy;
+    std::deque<_Command> m_history; // Newest at the back
+    size_t m_unsent;
+    uint16_t m_nextCmdSeq;
+    double m_lastSend;
+    bool m_connected;
+    bool m_closed;
+    std::string m_packet;
+    std::deque<std::string> m_snapshots; // Received and not taken yet, in arrival order
+    std::vector<std::string> m_reliable;
+    std::vector<uint8_t> m_buf;
+
+    void _send(UdpChannel::Type type, double now)
+    {
+        m_channel.begin(m_packet, type, now);
+        if(type == UdpChannel::Type::input)
+        {
+            size_t count = m_unsent + m_redundancy;
+            if(count > m_history.size())
+                count = m_history.size();
+            if(count > maxCommandsPerPacket)
+                count = maxCommandsPerPacket;
+            _wire::_put8(m_packet, static_cast<uint8_t>(count));
+            for(size_t i = m_history.size() - count; i < m_history.size(); ++i)
+            {
+                const _Command &cmd = m_history[i];
+                _wire::_put16(m_packet, cmd.seq);
+                _wire::_put8(m_packet, static_cast<uint8_t>(cmd.op));
+                _wire::_putDouble(m_packet, cmd.args[0]);
+                _wire::_putDouble(m_packet, cmd.args[1]);
+            }
+            m_unsent = 0;
+        }
+        m_loss.sendTo(m_sockFd, m_packet, m_server);
+        m_lastSend = now;
+    }
+public:
+    UdpClient(size_t redundancy = 4, double lossRate = 0.0, double duplicateRate = 0.0, uint32_t seed = 1)
+        : m_sockFd(INVALID_SOCKET), m_server(), m_loss(lossRate, duplicateRate, seed), m_redundancy(redundancy),
+          m_unsent(0), m_nextCmdSeq(0), m_lastSend(0.0), m_connected(false), m_closed(false),
+          m_buf(_udp::_maxDatagram){}
+    UdpClient(const UdpClient &) = delete;
+    ~UdpClient()
+    {
+        if(m_sockFd != INVALID_SOCKET)
+            closesocket(m_sockFd);
+    }
+
+    SocketT socketFd(void) const
+    {return m_sockFd;}
+    bool connected(void) const
+    {return m_connected;}
+    bool closed(void) const
+    {return m_closed;}
+    double rtt(void) const
+    {return m_channel.rtt();}
+
+    bool connect(const char *host, uint16_t port)
+    {
+        m_server.sin_family = AF_INET;
+        m_server.sin_port = htons(port);
+        if(inet_pton(AF_INET, host, &m_server.sin_addr) != 1)
+            return false;
+        m_sockFd = socket(AF_INET, SOCK_DGRAM, 0);
+        return m_sockFd != INVALID_SOCKET && setNonBlocking(m_sockFd);
+    }
+
+    // Returns the command's sequence number
+    uint16_t command(char op, double arg0 = 0.0, double arg1 = 0.0)
+    {
+        m_history.push_back(_Command{m_nextCmdSeq, op, {arg0, arg1}});
+        ++m_unsent;
+        while(m_history.size() > maxCommandsPerPacket)
+            m_history.pop_front();
+        return m_nextCmdSeq++;
+    }
+
+    // Disconnect travels on the reliable channel, so it survives packet loss.
+    void disconnect(void)
+    {m_channel.sendReliable("0");}
+
+    // Oldest snapshot not taken yet, in arrival order. A late one can be older than the one before it;
+    // compact ones still have to be decoded, later frames may use them as their baseline.
+    bool takeSnapshot(std::string &out)
+    {
+        if(m_snapshots.empty())
+            return false;
+        out.swap(m_snapshots.front());
+        m_snapshots.pop_front();
+        return true;
+    }
+
+    void pump(double now)
+    {
+        for(;;)
+        {
+            int len = recv(m_sockFd, reinterpret_cast<char *>(m_buf.data()), static_cast<int>(m_buf.size()), 0);
+            if(len <= 0)
+                break;
+            _wire::_Reader rd = {m_buf.data(), static_cast<size_t>(len), 0, true};
+            UdpChannel::Type type;
+            bool newest;
+            m_reliable.clear();
+            if(!m_channel.receive(rd, type, m_reliable, newest, now))
+                continue;
+            m_connected = true;
+            for(const std::string &msg : m_reliable) if(msg == "bye")
+                m_closed = true;
+            if(type == UdpChannel::Type::snapshot)
+            {
+                if(m_snapshots.size() >= maxSnapshotsQueued)
+                    m_snapshots.pop_front();
+                m_snapshots.emplace_back(reinterpret_cast<const char *>(m_buf.data() + rd.pos), rd.remaining());
+            }
+        }
+        if(!m_connected)
+        {
+            if(now - m_lastSend >= helloInterval)
+                _send(UdpChannel::Type::hello, now);
+        }
+        else if(m_unsent || m_channel.reliablePending() || now - m_lastSend >= keepAliveInterval)
+            _send(UdpChannel::Type::input, now);
+    }
+};
+
+#endif // _UDP_HPP_
@@ -0,0 +1,112 @@
+#ifndef _WIRE_HPP_
+#define _WIRE_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// Little-endian byte packing shared by the binary protocols (UDP headers, compact snapshots).
+namespace _wire
+{
+    inline void _put8(std::string &out, uint8_t v)
+    {out += static_cast<char>(v);}
+    inline void _put16(std::string &out, uint16_t v)
+    {
+        out += static_cast<char>(v & 0xFF);
+        out += static_cast<char>(v >> 8);
+    }
+    inline void _put32(std::string &out, uint32_t v)
+    {
+        _put16(out, static_cast<uint16_t>(v & 0xFFFF));
+        _put16(out, static_cast<uint16_t>(v >> 16));
+    }
+    inline void _putFloat(std::string &out, float v)
+    {
+        uint32_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        _put32(out, bits);
+    }
+    inline void _putDouble(std::string &out, double v)
+    {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        _put32(out, static_cast<uint32_t>(bits & 0xFFFFFFFFu));
+        _put32(out, static_cast<uint32_t>(bits >> 32));
+    }
+    // LEB128, 1 byte for values below 128
+    inline void _putVar(std::string &out, uint32_t v)
+    {
+        while(v >= 0x80)
+        {
+            out += static_cast<char>((v & 0x7F) | 0x80);
+            v >>= 7;
+        }
+        out += static_cast<char>(v);
+    }
+
+    struct _Reader
+    {
+        const uint8_t *data;
+        size_t size;
+        size_t pos;
+        bool ok;
+
+        bool _need(size_t n)
+        {return ok = ok && pos + n <= size;}
+        uint8_t get8(void)
+        {return _need(1) ? data[pos++] : 0;}
+        uint16_t get16(void)
+        {
+            if(!_need(2))
+                return 0;
+            uint16_t v = static_cast<uint16_t>(data[pos] | (data[pos + 1] << 8));
+            pos += 2;
+            return v;
+        }
+        uint32_t get32(void)
+        {
+            uint32_t lo = get16();
+            return lo | (static_cast<uint32_t>(get16()) << 16);
+        }
+        float getFloat(void)
+        {
+            uint32_t bits = get32();
+            float v;
+            memcpy(&v, &bits, sizeof(v));
+            return v;
+        }
+        double getDouble(void)
+        {
+            uint64_t lo = get32();
+            uint64_t bits = lo | (static_cast<uint64_t>(get32()) << 32);
+            double v;
+            memcpy(&v, &bits, sizeof(v));
+            return v;
+        }
+        uint32_t getVar(void)
+        {
+            uint32_t v = 0;
+            for(int shift = 0; shift < 35; shift += 7)
+            {
+                uint8_t byte = get8();
+                v |= static_cast<uint32_t>(byte & 0x7F) << shift;
+                if(!(byte & 0x80))
+                    return v;
+            }
+            ok = false;
+            return 0;
+        }
+        const char *bytes(size_t n)
+        {
+            if(!_need(n))
+                return nullptr;
+            const char *p = reinterpret_cast<const char *>(data + pos);
+            pos += n;
+            return p;
+        }
+        size_t remaining(void) const
+        {return size - pos;}
+    };
+}
+
+#endif // _WIRE_HPP_
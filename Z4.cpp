@@ -1,43 +1,35 @@
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdint.h>
-#if defined(__unix__) || defined(__unix)
-#include <sys/socket.h>
-typedef int SocketT;
-#elif defined(_WIN32) || defined(_WIN64)
-#include <winsock2.h>
-typedef SOCKET SocketT;
-#endif
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <random>
+#include "Log.hpp"
+#include "Net.hpp"
+#include "Profiler.hpp"
 #include "SteadyTimer.hpp"
 #include "Game.hpp"
+#include "Overload.hpp"
 SteadyTimer timer;
 double startTime;
 double pastTime;
-void debugPrintln(const char *format, ...)
-{
-    fprintf(stdout, "[%12.6lf]: ", timer() - startTime);
-    va_list args;
-    va_start(args, format);
-    vfprintf(stdout, format, args);
-    fputc('\n', stdout);
-    va_end(args);
-}
-void debugErrPrintln(const char *format, ...)
-{
-    fprintf(stderr, "[%12.6lf]: ", timer() - startTime);
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    fputc('\n', stderr);
-    va_end(args);
-}
+// Both only queue the message; Log.hpp formats and writes it on its own thread
+template<typename ...Args>
+void debugPrintln(const char *format, const Args &...args)
+{logPrintln(LogLevel::info, format, args...);}
+template<typename ...Args>
+void debugErrPrintln(const char *format, const Args &...args)
+{logPrintln(LogLevel::error, format, args...);}
 #define BUFSIZE1 512
 class Player : public Entity 
 {
 private:
-    SocketT m_sockFd;
-    std::string m_requestBuf;
-    char m_received[512];
+    uint32_t m_connId; // Owned by a NetThread; the player itself never sees the socket
+    bool m_connected = true;
+    uint32_t m_inputCount = 0; // Echoed in snapshots so clients can measure input latency
+    uint32_t m_snapshotDivisor = 1; // Chosen by the I/O thread from how fast the client drains its socket
 
     // 이동 상태 플래그 (m_ 접두사 사용)
     typedef int _CastType;
@@ -54,6 +46,14 @@ private:
     Flags m_flags = Flags::none;
 
     static constexpr double m_speed = 1.0;
+    static constexpr double m_pickupReach = 4.0; // Past the edge of the player
+    static constexpr double m_shotInterval = 0.2;
+    static constexpr double m_shotRange = 400.0;
+    static constexpr int m_shotDamage = 10;
+    uint32_t m_viewLag = 0; // Ticks the client's screen is behind, from the tick it sent with its last '9'
+    bool m_shotReady = true; // Cleared by a shot until m_shotGate fires
+    Timer m_shotGate;
+    uint64_t m_lastMoveTick; // A coarse room tick moves the player for every game tick it stands for
 
     PointVector m_screenSize = {0, 0};
     PointVector m_direction = {0, 1}; // 기본 방향: 위쪽
@@ -73,8 +73,30 @@ public:
     {return lhs = lhs ^ rhs;}
     friend inline Flags& operator|=(Flags& lhs, Flags rhs)
     {return lhs = lhs | rhs;}
-    Player(const char* name, SocketT sockFd, const PointVector &pos, const Team *team)
-        : Entity(pos, team, name, 120, 8), m_sockFd(sockFd) {}
+    Player(Game *game, const char* name, uint32_t connId, const PointVector &pos, const Team *team)
+        : Entity(game, pos, team, name, 120, 8), m_connId(connId), m_lastMoveTick(game->timers().now()) {}
+    uint32_t connId(void) const {
+        return m_connId;
+    }
+    bool connected(void) const {
+        return m_connected;
+    }
+    const PointVector &screenSize(void) const {
+        return m_screenSize;
+    }
+    uint32_t inputCount(void) const {
+        return m_inputCount;
+    }
+    uint32_t snapshotDivisor(void) const {
+        return m_snapshotDivisor;
+    }
+    void setSnapshotDivisor(uint32_t divisor) {
+        m_snapshotDivisor = divisor ? divisor : 1;
+    }
+    void handleCommand(const NetCommand &cmd) {
+        m_inputCount = cmd.seq ? cmd.seq : m_inputCount + 1;
+        _processCommand(cmd);
+    }
     void enableFlag(Flags f) {
         m_flags |= f;
     }
@@ -99,65 +121,72 @@ public:
         if (hasAllFlags(Flags::moveForward) != hasAllFlags(Flags::moveBackward))
         {
             if(hasAllFlags(Flags::moveForward))
-                delta += m_direction * m_speed;
+                delta += m_direction * moveDist;
             else
-                delta -= m_direction * m_speed;
+                delta -= m_direction * moveDist;
             moveX = true;
         }
         if (hasAllFlags(Flags::moveLeft) != hasAllFlags(Flags::moveRight))
         {
             if(hasAllFlags(Flags::moveLeft))
-                delta += PointVector(-m_direction[1], m_direction[0]) * m_speed;
+                delta += PointVector(-m_direction[1], m_direction[0]) * moveDist;
             else
-                delta -= PointVector(-m_direction[1], m_direction[0]) * m_speed;
+                delta -= PointVector(-m_direction[1], m_direction[0]) * moveDist;
             if(moveX)
                 delta /= sqrt(2);
         }
         setPosition(position() + delta);
     }
+    // Commands have already been applied by handleCommand() before the tick; nothing here blocks.
     virtual void update(void) override
     {
-        int len = recv(m_sockFd, m_received, sizeof(m_received) - 1, 0);
-        if (len <= 0) {
-            disconnect();
-            return;
-        }
-        m_received[len] = '\0';
-        for (int i = 0; i < len; ++i) {
-            if (m_received[i] == '\n') {
-                _processCommand(m_requestBuf.c_str());
-                m_requestBuf.clear();
-            } else {
-                m_requestBuf += m_received[i];
-            }
-        }
-        applyMove(m_speed);
+        uint64_t now = game()->timers().now();
+        uint64_t ticks = (now > m_lastMoveTick) ? now - m_lastMoveTick : 1;
+        m_lastMoveTick = now;
+        if (!m_connected) return;
+        applyMove(m_speed * ticks);
         if (hasAllFlags(Flags::shoot)) _doShoot();
-        const char* response = "ACK\n";
-        send(m_sockFd, response, strlen(response), 0);
     }
 
 private:
+    // Hit test against where things were on the client's screen, not where they are now
     void _doShoot(void)
     {
-
+        if(!m_shotReady)
+            return;
+        m_shotReady = false;
+        game()->timers().scheduleIn(m_shotGate, m_shotInterval, [this]{m_shotReady = true;});
+        uint32_t tick = game()->history().newestTick() - m_viewLag;
+        EntityPtr hit = game()->rewindRaycast(tick, position(), m_direction, m_shotRange, this);
+        if(hit)
+            hit->healthEvent(this, -m_shotDamage);
     }
     void _doReload(void)
     {
         disableFlag(Flags::shoot);
     }
+    // Picks up the nearest item in reach; items sit in a packed index, so this is a handful of comparisons
     void _doInteract(void)
     {
-
+        double reach = size() + m_pickupReach;
+        PointVector corner(reach, reach);
+        PositionedObjectPtr nearest;
+        game()->itemField().query(Rect(position() - corner, position() + corner), [&](const PositionedObjectPtr &obj){
+            double dist = (obj->position() - position()).length();
+            if(dist <= reach)
+            {
+                reach = dist;
+                nearest = obj;
+            }
+        });
+        if(nearest)
+            static_cast<DroppedItem &>(*nearest).interact(this);
     }
     // 명령 처리 함수
-    void _processCommand(const char *cmd)
+    void _processCommand(const NetCommand &cmd)
     {
-        if (!cmd) return;
-        char op = cmd[0];
-        switch (op)
+        switch (cmd.op)
         {
-        case '\0': break;
         case '0': disconnect(); break;
         case '1': enableFlag(Flags::moveForward); break;
         case '2': disableFlag(Flags::moveForward); break;
@@ -167,22 +196,17 @@ private:
         case '6': disableFlag(Flags::moveBackward); break;
         case '7': enableFlag(Flags::moveRight); break;
         case '8': disableFlag(Flags::moveRight); break;
-        case '9': enableFlag(Flags::shoot); break;
+        case '9':
+            enableFlag(Flags::shoot);
+            // Kept as a lag rather than a tick, so holding the trigger keeps rewinding by the same amount
+            if(cmd.args[0] > 0.0 && cmd.args[0] <= game()->history().newestTick())
+                m_viewLag = game()->history().newestTick() - static_cast<uint32_t>(cmd.args[0]);
+            break;
         case 'A': disableFlag(Flags::shoot); break;
         case 'B': _doReload(); break;
         case 'C': _doInteract(); break;
-        case 'D': {
-            double rad = 0.0;
-            if (sscanf(cmd + 1, "%lf", &rad) == 1)
-                setDirection(rad);
-            break;
-        }
-        case 'E': {
-            double x = 0.0, y = 0.0;
-            if (sscanf(cmd + 1, "%lf %lf", &x, &y) == 2)
-                m_screenSize = {x, y};
-            break;
-        }
+        case 'D': setDirection(cmd.args[0]); break;
+        case 'E': m_screenSize = {cmd.args[0], cmd.args[1]}; break;
         default: break;
         }
 
@@ -212,18 +236,23 @@ private:
 
     // 이동 상태 설정 함수들
 
+public:
+    // The owning NetThread closes the socket once the sim has sent NetOutput::Kind::close.
     void disconnect()
     {
-        if (m_sockFd != INVALID_SOCKET)
-            closesocket(m_sockFd);
-        m_sockFd = INVALID_SOCKET;
+        m_connected = false;
     }
 
-    ~Player()
+    virtual void saveState(EntityRecord &rec, double now) const override
     {
-        disconnect();
+        Entity::saveState(rec, now);
+        rec.kind = static_cast<uint8_t>(CheckpointEntityKind::player);
+        rec.flags = static_cast<uint16_t>(m_flags);
+        rec.dirX = m_direction[0];
+        rec.dirY = m_direction[1];
     }
 };
+typedef std::shared_ptr<Player> PlayerPtr;
 struct ZombiePreset
 {
     const char *name;
@@ -236,68 +265,133 @@ struct ZombiePreset
 class Zombie : public Entity
 {
 private:
-    Entity* m_defaultTrack;
-    Entity* m_attackedBy;
+    EntityWeakPtr m_defaultTrack;
+    EntityWeakPtr m_attackedBy; // A player who hit it may disconnect, and be freed, at any time
     int m_damage;
     double m_speed;
     double m_attackCooldown;
-    double m_lastTick;
-    double m_lastAttackTime;
+    bool m_attackReady = true;
+    uint64_t m_lastAttackTick = 0;
+    uint64_t m_lastUpdateTick; // Behind the clock while the room only updates it now and then
+    Timer m_cooldown; // Sets m_attackReady again; nothing looks at the clock in between
 
 public:
-    Zombie(Game *game, const char *name, const ZombiePreset &zp, const PointVector &pos, const Team *team, Entity* defaultTarget)
+    Zombie(Game *game, const char *name, const ZombiePreset &zp, const PointVector &pos, const Team *team, const EntityPtr &defaultTarget)
         : Entity(game, pos, team, zp.name, zp.healthMax, zp.size),
           m_defaultTrack(defaultTarget), m_attackedBy(), m_damage(zp.damage),
-          m_speed(zp.speed), m_attackCooldown(zp.attackCooldown),
-          m_lastTick(0.0), m_lastAttackTime(0.0) {}
+          m_speed(zp.speed), m_attackCooldown(zp.attackCooldown), m_lastUpdateTick(game->timers().now()) {}
 
+    // Chasing whoever hit it rather than walking to its default target
+    bool engaged(void) const
+    {return !m_attackedBy.expired();}
+
+    // Fine to call only every few ticks while nothing is close: the ticks it missed are made up as one
+    // straight walk towards the target, which is what they would have been.
     virtual void update(void) override
     {
-        Entity* target = nullptr;
-        if (m_attackedBy)
-        {
-            if(!m_attackedBy->valid())
-                m_attackedBy = nullptr;
-            else
-                target = m_attackedBy;
-        }
-        else if (m_defaultTrack)
-        {
-            if(!m_defaultTrack->valid())
-                m_defaultTrack = nullptr;
-            else
-                target = m_defaultTrack;
-        }
-        double now = timer();
+        EntityPtr target = _target();
+        uint64_t now = game()->timers().now();
+        uint64_t missed = (now > m_lastUpdateTick) ? now - m_lastUpdateTick - 1 : 0;
+        m_lastUpdateTick = now;
+        if(target && missed)
+            _walk(*target, missed);
         if(target)
         {
             PointVector toTarget = target->position() - position();
             double dist = toTarget.length();
             if (dist <= size() + target->size()) // Within attack range
             {
-                if (now - m_lastAttackTime >= m_attackCooldown)
-                {
-                    target->healthEvent(this, -m_damage);
-                    m_lastAttackTime = now;
-                }
+                if (m_attackReady)
+                    _attack(*target);
             }
             else
-            {
-                if (now != m_lastTick)
-                {
-                    double dt = now - m_lastTick;
-                    PointVector moveVec = toTarget.normalized() * m_speed * dt;
-                    setPosition(position() + moveVec);
-                }
-            }
+                _walk(*target, 1); // Same steps whether caught up or not, so the path does not depend on the LOD
         }
-        m_lastTick = now;
     }
 
     virtual void healthEvent(Entity* entityPtr, int deltaHealth) override
     {
         setHealth(health() + deltaHealth);
-        m_attackedBy = entityPtr;
+        if (entityPtr)
+            m_attackedBy = entityPtr->weak_from_this();
+        else
+            m_attackedBy.reset();
+    }
+
+private:
+    EntityPtr _target(void)
+    {
+        if (EntityPtr attacker = m_attackedBy.lock())
+        {
+            if (attacker->valid())
+                return attacker;
+        }
+        m_attackedBy.reset();
+        if (EntityPtr track = m_defaultTrack.lock())
+        {
+            if (track->valid())
+                return track;
+        }
+        m_defaultTrack.reset();
+        return nullptr;
+    }
+    // Straight towards target for ticks ticks, stopping at attack range
+    void _walk(const Entity &target, uint64_t ticks)
+    {
+        PointVector toTarget = target.position() - position();
+        double gap = toTarget.length() - (size() + target.size());
+        if (gap <= 0.0)
+            return;
+        double step = m_speed * game()->timers().tickSeconds() * ticks;
+        setPosition(position() + toTarget.normalized() * ((step < gap) ? step : gap));
+    }
+    void _attack(Entity &target)
+    {
+        target.healthEvent(this, -m_damage);
+        m_lastAttackTick = game()->timers().now();
+        _coolDown(m_attackCooldown);
+    }
+    void _coolDown(double seconds)
+    {
+        m_attackReady = false;
+        game()->timers().scheduleIn(m_cooldown, seconds, [this]{m_attackReady = true;});
+    }
+public:
+
+    virtual void saveState(EntityRecord &rec, double now) const override
+    {
+        Entity::saveState(rec, now);
+        rec.kind = static_cast<uint8_t>(CheckpointEntityKind::zombie);
+        EntityPtr track = m_defaultTrack.lock(), attacker = m_attackedBy.lock();
+        rec.track = track ? track->id() : 0;
+        rec.attackedBy = attacker ? attacker->id() : 0;
+        rec.damage = m_damage;
+        rec.speed = m_speed;
+        rec.attackCooldown = m_attackCooldown;
+        const TimerWheel &timers = game()->timers();
+        rec.lastAttack = m_lastAttackTick ? -static_cast<double>(timers.now() - m_lastAttackTick) * timers.tickSeconds() : -m_attackCooldown;
+    }
+    virtual void restoreState(const EntityRecord &rec, double now) override
+    {
+        Entity::restoreState(rec, now);
+        m_damage = rec.damage;
+        m_speed = rec.speed;
+        m_attackCooldown = rec.attackCooldown;
+        // Only the rest of the cooldown; the game clock has already been wound to the saved tick
+        double remaining = m_attackCooldown + rec.lastAttack;
+        if(remaining > 0.0)
+        {
+            const TimerWheel &timers = game()->timers();
+            uint64_t ago = timers.ticks(-rec.lastAttack);
+            m_lastAttackTick = (ago < timers.now()) ? timers.now() - ago : 1;
+            _coolDown(remaining);
+        }
+    }
+    // Targets are saved as ids; these are the restored entities, or nullptr if they did not come back
+    void relink(const EntityPtr &defaultTrack, const EntityPtr &attackedBy)
+    {
+        m_defaultTrack = defaultTrack;
+        m_attackedBy = attackedBy;
     }
 };
 
@@ -320,12 +414,13 @@ protected:
     double      m_size        = 1.0;
     int         m_ammoCount   = 0;
     int         m_ammoMax     = 0;
-    double      m_lastTick    = 0.0;
     double      m_rate        = 0.1;
-    double      m_fireTime    = 0;
     double      m_reloadTime  = 0.0;
-    double      m_reloadStart = 0.0;
+    double      m_reloadStart = 0.0; // Game time, in seconds
     Flags       m_flags       = Flags::none;
+    bool        m_ready       = true; // Cleared by a shot until m_fireGate fires
+    Timer       m_fireGate;
+    Timer       m_reloadDone;
 
 public:
     friend constexpr Flags operator~(Flags lhs)
@@ -369,54 +464,896 @@ public:
     Gun(Game *game, const char *name, double size, int ammoCount, double rate, double reloadTime = -1)
         : m_game(game), m_name(name), m_size(size), m_ammoCount(ammoCount), m_ammoMax(ammoCount), m_rate(rate), m_reloadTime(reloadTime), m_reloadStart(0){}
     virtual BulletPtr shoot(void) = 0;
+    // Reload and fire rate are timers on the game's wheel, so an idle gun costs nothing here
     BulletPtr updateGun(void)
     {
-        double now = timer();
+        if(!m_ready || hasAllFlags(Flags::isReloading) || !hasAllFlags(Flags::isFiring))
+            return nullptr;
+        if(!hasAnyFlag(Flags::isAuto))
+            disableFlag(Flags::isFiring);
+        m_ready = false;
+        m_game->timers().scheduleIn(m_fireGate, m_rate, [this]{m_ready = true;});
+        return shoot();
+    }
+    void reload(void)
+    {
+        if(hasAllFlags(Flags::isReloading))
+            return;
+        enableFlag(Flags::isReloading);
+        const TimerWheel &timers = m_game->timers();
+        m_reloadStart = timers.now() * timers.tickSeconds();
+        m_game->timers().scheduleIn(m_reloadDone, m_reloadTime, [this]{_reloaded();});
+    }
+    // For whoever carries the gun, from its own saveState() and restoreState(); restore after the
+    // game clock has been wound to the saved tick
+    void saveState(EntityRecord &rec) const
+    {
+        const double tickSeconds = m_game->timers().tickSeconds();
+        rec.ammo = m_ammoCount;
+        rec.gunFlags = static_cast<uint32_t>(m_flags);
+        rec.gunReady = m_fireGate.remaining() * tickSeconds;
+        rec.reloadDone = m_reloadDone.remaining() * tickSeconds;
+    }
+    void restoreState(const EntityRecord &rec)
+    {
+        TimerWheel &timers = m_game->timers();
+        m_ammoCount = rec.ammo;
+        m_flags = static_cast<Flags>(rec.gunFlags);
+        m_ready = !(rec.gunReady > 0.0);
+        if(!m_ready)
+            timers.scheduleIn(m_fireGate, rec.gunReady, [this]{m_ready = true;});
         if(hasAllFlags(Flags::isReloading))
         {
-            if(now - m_reloadStart >= m_reloadTime)
-                m_ammoCount = m_ammoMax;
-            disableFlag(Flags::isReloading);
-        }
-        else if(hasAllFlags(Flags::isFiring))
-        {
-            if(now - m_fireTime >= m_rate)
-                return shoot();
-            m_fireTime = now;
-            if(!hasAnyFlag(Flags::isAuto))
-                disableFlag(Flags::isFiring);
+            m_reloadStart = timers.now() * timers.tickSeconds() - (m_reloadTime - rec.reloadDone);
+            timers.scheduleIn(m_reloadDone, rec.reloadDone, [this]{_reloaded();});
         }
-        return nullptr;
     }
-    void reload(void)
+    virtual ~Gun() = default;
+private:
+    void _reloaded(void)
     {
-        m_reloadStart = timer();
-        m_lastTick = 
+        m_ammoCount = m_ammoMax;
+        disableFlag(Flags::isReloading);
     }
-    virtual ~Gun() = default;
 };
 
-Team human = {"human"};
-Team zombie = {"zombie"};
 class Crystal : public Entity
 {
 public:
     Crystal(Game *game,const Team *team)
         : Entity(game, {0,0}, team, "Crystal", 10000, 30){}
     virtual void update(void) override{}
+    virtual void saveState(EntityRecord &rec, double now) const override
+    {
+        Entity::saveState(rec, now);
+        rec.kind = static_cast<uint8_t>(CheckpointEntityKind::crystal);
+    }
 };
-EntityPtr crystal = std::make_shared<Crystal>(&human);
+
+static constexpr uint16_t serverPort = 1024;
+static constexpr size_t netThreadCount = 2;
+static constexpr double tickInterval = 1.0 / 30.0;
+static constexpr double checkpointInterval = 5.0;
+static constexpr Rect everywhere({0.0, 0.0}, {0.0, 0.0}, completelyLoose);
+static constexpr size_t roomCapacity = 16;        // Players per room before the lobby opens up another one
+static constexpr double statsInterval = 1.0;      // Walking the trees is not free, once a second is plenty
+static constexpr double rebalanceInterval = 1.0;
+// Zombie level of detail: out of every player's view (plus the margin) and away from the crystal,
+// a zombie is updated once every zombieLodTicks room ticks instead of every tick.
+// Under load the room's OverloadController scales both distances down.
+static constexpr uint32_t zombieLodTicks = 8;
+static constexpr double zombieLodMargin = 64.0;
+static constexpr double zombieLodCrystalRange = 200.0;
+
+EntityState entityState(const Entity &ent)
+{
+    const PointVector &pos = ent.position();
+    return EntityState{ent.id(), pos[0], pos[1], ent.size(), ent.team() ? ent.team()->id : -1, ent.health(), ent.healthMax()};
+}
+
+void fillSnapshot(Game &game, const Entity &crystal, Player &player, uint32_t tick, double time, Snapshot &snap)
+{
+    snap.clear();
+    snap.tick = tick;
+    snap.time = time;
+    snap.inputs = player.inputCount();
+    snap.me = entityState(player);
+    snap.crystal = entityState(crystal);
+    PointVector half = player.screenSize() * 0.5;
+    Rect view(player.position() - half, player.position() + half);
+    game.entityField().query(view, [&](const PositionedObjectPtr &obj){
+        snap.entities.push_back(entityState(static_cast<const Entity &>(*obj)));
+    });
+    game.itemField().query(view, [&](const PositionedObjectPtr &obj){
+        const DroppedItem &item = static_cast<const DroppedItem &>(*obj);
+        snap.dropItems.push_back(ItemState{item.position()[0], item.position()[1], item.size(), item.name()});
+    });
+}
+
+// Entities keep their names as bare pointers, so names read back from a checkpoint live here for good.
+// Rooms restore on the main thread before the shards start, so this needs no lock.
+const char *internName(const char *name)
+{
+    static std::unordered_set<std::string> names;
+    return names.insert(name).first->c_str();
+}
+
+void saveEntity(CheckpointBuilder &builder, const Entity &ent, double now)
+{
+    EntityRecord &rec = builder.addEntity();
+    ent.saveState(rec, now);
+    rec.name = builder.addString(ent.name());
+}
+
+// One independent match: its own Game, teams, crystal, clock and RNG.
+// Only the shard that currently owns a room ever touches it, so nothing in here is shared or locked.
+class Room
+{
+private:
+    uint32_t m_id;
+    Team m_human = {"human", 0};
+    Team m_zombie = {"zombie", 1};
+    Game m_game;
+    EntityPtr m_crystal;
+    std::unordered_map<uint32_t, PlayerPtr> m_players;
+    std::vector<std::shared_ptr<Zombie>> m_zombies;
+    std::vector<Bounds> m_interest; // Scratch: what the players can see this tick, plus zombieLodMargin
+    OverloadController m_overload;
+    uint32_t m_tick = 0;  // Game ticks
+    uint32_t m_frame = 0; // Room ticks; fewer than game ticks while the room runs coarse ticks
+    double m_startTime;
+    double m_pastTime;
+    std::unique_ptr<CheckpointWriter> m_checkpoints;
+    CheckpointBuilder m_checkpointBuilder;
+    double m_lastCheckpoint;
+
+    const Team *_teamById(int id) const
+    {
+        if(id == m_human.id)
+            return &m_human;
+        if(id == m_zombie.id)
+            return &m_zombie;
+        return nullptr;
+    }
+
+    // Far zombies only walk towards the crystal, which Zombie::update() can make up for in one go later.
+    // They are staggered by id so every tick does about the same share. Their tree nodes only see the
+    // move when they are updated, so the index is touched once per zombieLodTicks for them too.
+    void _updateZombies(double lodScale)
+    {
+        const double margin = zombieLodMargin * lodScale, crystalRange = zombieLodCrystalRange * lodScale;
+        m_interest.clear();
+        for(auto &entry : m_players)
+        {
+            PointVector half = entry.second->screenSize() * 0.5 + PointVector(margin, margin);
+            m_interest.emplace_back(entry.second->position() - half, entry.second->position() + half);
+        }
+        size_t kept = 0;
+        for(size_t i = 0; i < m_zombies.size(); ++i)
+        {
+            std::shared_ptr<Zombie> &zomb = m_zombies[i];
+            if(!zomb->valid())
+                continue;
+            bool near = zomb->engaged() || (zomb->position() - m_crystal->position()).length() <= crystalRange;
+            for(size_t p = 0; !near && p < m_interest.size(); ++p)
+                near = m_interest[p].contains(zomb->position());
+            if(near || (m_frame + zomb->id()) % zombieLodTicks == 0)
+                zomb->update();
+            if(kept != i)
+                m_zombies[kept] = std::move(zomb);
+            ++kept;
+        }
+        m_zombies.resize(kept);
+    }
+
+    // Runs on the tick: only copies plain values, the file is written by CheckpointWriter
+    void _buildCheckpoint(double now)
+    {
+        m_checkpointBuilder.clear();
+        saveEntity(m_checkpointBuilder, *m_crystal, now);
+        m_game.entityField().query(everywhere, [&](const PositionedObjectPtr &obj){
+            saveEntity(m_checkpointBuilder, static_cast<const Entity &>(*obj), now);
+        });
+        m_game.itemField().query(everywhere, [&](const PositionedObjectPtr &obj){
+            const DroppedItem &item = static_cast<const DroppedItem &>(*obj);
+            ItemRecord &rec = m_checkpointBuilder.addItem();
+            rec.x = item.position()[0];
+            rec.y = item.position()[1];
+            rec.size = item.size();
+            rec.name = m_checkpointBuilder.addString(item.name());
+            rec.cost = item.cost();
+            rec.despawn = item.despawnRemaining();
+        });
+        for(const BulletPtr &bullet : m_game.bulletField())
+        {
+            BulletRecord &rec = m_checkpointBuilder.addBullet();
+            rec.x = bullet->position()[0];
+            rec.y = bullet->position()[1];
+        }
+    }
+
+    // Items come back as SavedItems, with what was left of their despawn time
+    size_t _restoreItems(const CheckpointFile &file)
+    {
+        size_t count;
+        const ItemRecord *recs = file.records<ItemRecord>(CheckpointSectionType::items, count);
+        for(size_t i = 0; i < count; ++i)
+        {
+            const ItemRecord &rec = recs[i];
+            std::shared_ptr<SavedItem> item = std::make_shared<SavedItem>(&m_game, PointVector(rec.x, rec.y),
+                internName(file.string(rec.name)), rec.size);
+            item->setCost(rec.cost);
+            if(rec.despawn >= 0.0)
+                item->despawnAfter(rec.despawn);
+            m_game.itemField().insert(item);
+        }
+        return count;
+    }
+
+    // Players are saved but not brought back: their connections died with the old process, and whoever
+    // reconnects gets a new player. Bullets have no concrete types to rebuild yet.
+    size_t _restoreCheckpoint(const CheckpointFile &file, double now)
+    {
+        size_t count, restoredCount = 0;
+        const EntityRecord *recs = file.records<EntityRecord>(CheckpointSectionType::entities, count);
+        std::unordered_map<uint32_t, EntityPtr> restored;
+        std::vector<std::pair<std::shared_ptr<Zombie>, const EntityRecord *>> zombies;
+        for(size_t i = 0; i < count; ++i)
+        {
+            const EntityRecord &rec = recs[i];
+            EntityPtr ent;
+            switch(static_cast<CheckpointEntityKind>(rec.kind))
+            {
+            case CheckpointEntityKind::crystal:
+                m_crystal->restoreState(rec, now);
+                restored.emplace(rec.id, m_crystal);
+                ++restoredCount;
+                continue; // Not in the entity tree
+            case CheckpointEntityKind::zombie: {
+                ZombiePreset preset = {internName(file.string(rec.name)), rec.healthMax, rec.size, rec.damage, rec.attackCooldown, rec.speed};
+                std::shared_ptr<Zombie> zomb = std::make_shared<Zombie>(&m_game, preset.name, preset,
+                    PointVector(rec.x, rec.y), _teamById(rec.team), nullptr);
+                zombies.emplace_back(zomb, &rec);
+                m_zombies.push_back(zomb);
+                ent = zomb;
+                break;
+            }
+            default:
+                continue;
+            }
+            ent->restoreState(rec, now);
+            m_game.entityField().insert(ent);
+            restored.emplace(rec.id, ent);
+            ++restoredCount;
+        }
+        auto lookup = [&](uint32_t id) -> EntityPtr {
+            auto found = restored.find(id);
+            return (found != restored.end()) ? found->second : nullptr;
+        };
+        for(auto &entry : zombies)
+            entry.first->relink(lookup(entry.second->track), lookup(entry.second->attackedBy));
+        return restoredCount;
+    }
+public:
+    Room(uint32_t id, uint32_t seed, double now, bool autoTuneTrees, bool overloadControl)
+        : m_id(id), m_game(Rect({0.0, 0.0}, {0.0, 0.0}, completelyLoose), 1, 8, tickInterval),
+          m_crystal(std::make_shared<Crystal>(&m_game, &m_human)), m_overload(tickInterval, overloadControl),
+          m_startTime(now), m_pastTime(now), m_lastCheckpoint(now)
+    {
+        m_game.rng().seed(seed);
+        m_game.setTreeAutoTune(autoTuneTrees);
+    }
+    Room(const Room &) = delete;
+
+    uint32_t id(void) const
+    {return m_id;}
+    size_t playerCount(void) const
+    {return m_players.size();}
+    // Between matches: nobody is playing, so the room may move to another shard
+    bool idle(void) const
+    {return m_players.empty();}
+    double nextTick(void) const
+    {return m_pastTime + tickInterval * m_overload.level().tickStride;}
+
+    // Resumes from path if it holds a checkpoint, then keeps writing new ones there
+    void enableCheckpoints(const std::string &path)
+    {
+        CheckpointFile file;
+        if(file.open(path))
+        {
+            double now = timer();
+            m_tick = file.header().tick;
+            m_game.timers().advance(m_tick); // Restored cooldowns count from the saved tick
+            size_t restored = _restoreCheckpoint(file, now), items = _restoreItems(file);
+            m_startTime = now - file.header().time; // Snapshot times carry on from where the match was
+            debugPrintln("Room %u: restored %u entities and %u items from %s (tick %u, %.1lf s into the match)",
+                m_id, restored, items, path, m_tick, file.header().time);
+        }
+        m_checkpoints.reset(new CheckpointWriter(path));
+    }
+
+    void handle(const NetCommand &cmd)
+    {
+        switch(cmd.kind)
+        {
+        case NetCommand::Kind::connected: {
+            PlayerPtr player = std::make_shared<Player>(&m_game, "Player", cmd.connId, m_crystal->position(), &m_human);
+            m_players.emplace(cmd.connId, player);
+            m_game.entityField().insert(player);
+            debugPrintln("Player %08x connected to room %u", cmd.connId, m_id);
+            break;
+        }
+        case NetCommand::Kind::disconnected: {
+            auto found = m_players.find(cmd.connId);
+            if(found == m_players.end())
+                break;
+            m_game.entityField().remove(found->second);
+            m_players.erase(found);
+            debugPrintln("Player %08x disconnected", cmd.connId);
+            break;
+        }
+        case NetCommand::Kind::input: {
+            auto found = m_players.find(cmd.connId);
+            if(found != m_players.end())
+                found->second->handleCommand(cmd);
+            break;
+        }
+        case NetCommand::Kind::snapshotRate: {
+            auto found = m_players.find(cmd.connId);
+            if(found != m_players.end())
+                found->second->setSnapshotDivisor(static_cast<uint32_t>(cmd.args[0]));
+            break;
+        }
+        }
+    }
+
+    void tick(double now, NetServer &server)
+    {
+        PROFILE_ZONE(ProfileZoneId::tick);
+        const double start = timer();
+        const OverloadLevel &level = m_overload.level();
+        m_pastTime = now;
+        ++m_frame;
+        // A coarse tick stands for tickStride game ticks. The ones skipped are recorded with everybody
+        // where they were, so rewinding still finds every tick; the moves all land on the last one.
+        for(uint32_t skip = 1; skip < level.tickStride; ++skip)
+        {
+            m_game.timers().advance(++m_tick);
+            m_game.recordHistory(m_tick);
+        }
+        ++m_tick;
+        m_game.timers().advance(m_tick);
+
+        {
+            PROFILE_ZONE(ProfileZoneId::update);
+            for(auto &entry : m_players)
+                entry.second->update();
+            _updateZombies(level.lodScale);
+        }
+        {
+            PROFILE_ZONE(ProfileZoneId::tree);
+            m_game.tuneTrees();
+        }
+        m_game.recordHistory(m_tick);
+
+        // Output: one snapshot record per player, encoded and sent by the owning I/O thread.
+        // Slow clients are on a reduced rate, so we do not even build the snapshots they would drop.
+        // The overload divisor sheds more on top of that for everyone.
+        for(auto &entry : m_players)
+        {
+            NetOutput out;
+            out.connId = entry.first;
+            if(!entry.second->connected())
+                out.kind = NetOutput::Kind::close;
+            else if(m_frame % entry.second->snapshotDivisor())
+                continue;
+            else if(m_frame % (entry.second->snapshotDivisor() * level.snapshotDivisor))
+            {
+                m_overload.shedSnapshot();
+                continue;
+            }
+            else
+            {
+                PROFILE_ZONE(ProfileZoneId::snapshotBuild);
+                out.snapshot.reset(new Snapshot);
+                fillSnapshot(m_game, *m_crystal, *entry.second, m_tick, now - m_startTime, *out.snapshot);
+            }
+            PROFILE_ZONE(ProfileZoneId::send);
+            server.send(std::move(out)); // A full queue only drops this tick's snapshot
+        }
+
+        // A busy writer just means trying again next tick
+        if(m_checkpoints && now - m_lastCheckpoint >= checkpointInterval)
+        {
+            std::vector<char> *image = m_checkpoints->acquire();
+            if(image)
+            {
+                PROFILE_ZONE(ProfileZoneId::checkpoint);
+                _buildCheckpoint(now);
+                m_checkpointBuilder.write(*image, m_tick, now - m_startTime);
+                m_checkpoints->submit();
+                m_lastCheckpoint = now;
+            }
+        }
+
+        if(m_overload.record(timer() - start))
+        {
+            const OverloadLevel &next = m_overload.level();
+            debugPrintln("Room %u: overload level %u (tick %.2lf ms avg): snapshots /%u, LOD x%.2lf, %u game ticks per tick",
+                m_id, m_overload.levelIndex(), m_overload.averageCost() * 1e3, next.snapshotDivisor, next.lodScale,
+                next.tickStride);
+        }
+    }
+
+    void collectStats(TreeStats &entities, TreeStats &items) const
+    {
+        m_game.entityField().collectStats(entities);
+        m_game.itemField().collectStats(items);
+    }
+    void collectOverload(OverloadStats &stats) const
+    {m_overload.collectStats(stats);}
+};
+typedef std::unique_ptr<Room> RoomPtr;
+
+class Lobby;
+
+// What the lobby, or another shard handing over a room, tells a shard
+struct ShardMessage
+{
+    enum class Kind : uint8_t
+    {
+        command,    // cmd for room roomId
+        adopt,      // room is ours from now on
+        release     // hand room roomId over to shard target
+    };
+    Kind kind = Kind::command;
+    uint32_t roomId = 0;
+    uint32_t target = 0;
+    NetCommand cmd;
+    RoomPtr room;
+};
+
+// One simulation thread running a set of rooms, each on its own tick schedule.
+// Commands come in through the inbox in the order the lobby routed them, so a room sees its
+// players' input in order even though the shard serves many rooms.
+class RoomShard
+{
+public:
+    static constexpr size_t inboxCapacity = 8192;
+    typedef MpscQueue<ShardMessage, inboxCapacity> Inbox;
+private:
+    uint32_t m_index;
+    Lobby &m_lobby;
+    NetServer &m_server;
+    Inbox m_inbox;
+    std::vector<RoomPtr> m_rooms;
+    std::deque<ShardMessage> m_handoffs; // Rooms released while the target's inbox was full
+    double m_lastStats;
+    std::atomic<size_t> m_entities;
+    std::atomic<size_t> m_items;
+    std::atomic<size_t> m_treeNodes;
+    std::atomic<size_t> m_treeDepth;
+    std::atomic<uint64_t> m_overload[5]; // OverloadStats, field by field
+    std::atomic<bool> m_running;
+    std::thread m_thread;
+
+    Room *_find(uint32_t roomId)
+    {
+        for(RoomPtr &room : m_rooms) if(room->id() == roomId)
+            return room.get();
+        return nullptr;
+    }
+    void _receive(ShardMessage &msg);
+    void _flushHandoffs(void);
+    void _collectStats(void)
+    {
+        TreeStats entities, items;
+        for(const RoomPtr &room : m_rooms)
+            room->collectStats(entities, items);
+        m_entities.store(entities.objects, std::memory_order_relaxed);
+        m_items.store(items.objects, std::memory_order_relaxed);
+        m_treeNodes.store(entities.nodes + items.nodes, std::memory_order_relaxed);
+        m_treeDepth.store((entities.depth > items.depth) ? entities.depth : items.depth, std::memory_order_relaxed);
+        OverloadStats overload;
+        for(const RoomPtr &room : m_rooms)
+            room->collectOverload(overload);
+        const uint64_t values[] = {overload.level, overload.raises, overload.lowers, overload.overruns,
+            overload.snapshotsShed};
+        for(size_t i = 0; i < 5; ++i)
+            m_overload[i].store(values[i], std::memory_order_relaxed);
+    }
+    void _run(void);
+public:
+    RoomShard(uint32_t index, Lobby &lobby, NetServer &server)
+        : m_index(index), m_lobby(lobby), m_server(server), m_lastStats(0.0), m_entities(0), m_items(0),
+          m_treeNodes(0), m_treeDepth(0), m_running(false)
+    {
+        for(auto &value : m_overload)
+            value.store(0, std::memory_order_relaxed);
+    }
+    RoomShard(const RoomShard &) = delete;
+    ~RoomShard()
+    {stop();}
+
+    uint32_t index(void) const
+    {return m_index;}
+    Inbox &inbox(void)
+    {return m_inbox;}
+    // Before start() only
+    void adoptNow(RoomPtr &&room)
+    {m_rooms.push_back(std::move(room));}
+
+    size_t entities(void) const
+    {return m_entities.load(std::memory_order_relaxed);}
+    size_t items(void) const
+    {return m_items.load(std::memory_order_relaxed);}
+    size_t treeNodes(void) const
+    {return m_treeNodes.load(std::memory_order_relaxed);}
+    size_t treeDepth(void) const
+    {return m_treeDepth.load(std::memory_order_relaxed);}
+    void overload(OverloadStats &stats) const
+    {
+        uint64_t level = m_overload[0].load(std::memory_order_relaxed);
+        if(level > stats.level)
+            stats.level = level;
+        stats.raises += m_overload[1].load(std::memory_order_relaxed);
+        stats.lowers += m_overload[2].load(std::memory_order_relaxed);
+        stats.overruns += m_overload[3].load(std::memory_order_relaxed);
+        stats.snapshotsShed += m_overload[4].load(std::memory_order_relaxed);
+    }
+
+    void start(void)
+    {
+        m_running.store(true, std::memory_order_release);
+        m_thread = std::thread(&RoomShard::_run, this);
+    }
+    void stop(void)
+    {
+        m_running.store(false, std::memory_order_release);
+        if(m_thread.joinable())
+            m_thread.join();
+    }
+};
+
+// Runs on the main thread. Takes every command the I/O threads decoded, puts new connections in a room
+// and forwards the rest to the shard running that room. Between matches it moves idle rooms from busy
+// shards to quiet ones, so the next match starts where there is room for it.
+class Lobby
+{
+private:
+    struct RoomInfo
+    {
+        uint32_t shard;
+        size_t players;
+        bool migrating; // Released by its old shard, not adopted by the new one yet: nobody joins meanwhile
+    };
+    static constexpr uint32_t noRoom = UINT32_MAX;
+    NetServer &m_server;
+    std::vector<std::unique_ptr<RoomShard>> m_shards;
+    std::vector<RoomInfo> m_rooms; // Indexed by room id
+    std::unordered_map<uint32_t, uint32_t> m_connRooms; // noRoom while the connect waits in m_waiting
+    std::deque<NetCommand> m_waiting; // Connects that found every room migrating, and what followed them
+    std::vector<std::deque<ShardMessage>> m_backlog; // Per shard, what its full inbox did not take yet
+    MpscQueue<uint32_t, 256> m_adopted; // Room ids, from the shards that finished a move
+
+    size_t _shardLoad(uint32_t shard) const
+    {
+        size_t load = 0;
+        for(const RoomInfo &info : m_rooms) if(info.shard == shard)
+            load += 1 + info.players; // An empty room still costs its tick
+        return load;
+    }
+    // Fill rooms up before starting new matches; among equals, the room on the quietest shard.
+    // noRoom if every room is migrating.
+    uint32_t _chooseRoom(void) const
+    {
+        uint32_t best = noRoom;
+        bool found = false;
+        for(uint32_t id = 0; id < m_rooms.size(); ++id)
+        {
+            const RoomInfo &info = m_rooms[id];
+            if(info.migrating)
+                continue;
+            if(!found)
+            {
+                best = id;
+                found = true;
+                continue;
+            }
+            const RoomInfo &cur = m_rooms[best];
+            bool curFull = cur.players >= roomCapacity, full = info.players >= roomCapacity;
+            if(curFull != full)
+            {
+                if(curFull)
+                    best = id;
+            }
+            else if(full ? info.players < cur.players : info.players > cur.players)
+                best = id;
+            else if(info.players == cur.players && _shardLoad(info.shard) < _shardLoad(cur.shard))
+                best = id;
+        }
+        return best;
+    }
+    // Returns false if cmd has to wait for a room to finish migrating
+    bool _dispatch(const NetCommand &cmd)
+    {
+        uint32_t roomId;
+        if(cmd.kind == NetCommand::Kind::connected)
+        {
+            roomId = _chooseRoom();
+            m_connRooms[cmd.connId] = roomId;
+            if(roomId == noRoom)
+                return false;
+            ++m_rooms[roomId].players;
+        }
+        else
+        {
+            auto found = m_connRooms.find(cmd.connId);
+            if(found == m_connRooms.end())
+                return true;
+            roomId = found->second;
+            if(roomId == noRoom) // Its connect is still waiting; keep the order
+                return false;
+            if(cmd.kind == NetCommand::Kind::disconnected)
+            {
+                --m_rooms[roomId].players;
+                m_connRooms.erase(found);
+            }
+        }
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::command;
+        msg.roomId = roomId;
+        msg.cmd = cmd;
+        _post(m_rooms[roomId].shard, std::move(msg));
+        return true;
+    }
+    void _post(uint32_t shard, ShardMessage &&msg)
+    {
+        if(!m_backlog[shard].empty() || !m_shards[shard]->inbox().tryPush(std::move(msg)))
+            m_backlog[shard].push_back(std::move(msg));
+    }
+    void _flushBacklog(void)
+    {
+        for(size_t shard = 0; shard < m_backlog.size(); ++shard)
+        {
+            std::deque<ShardMessage> &backlog = m_backlog[shard];
+            while(!backlog.empty() && m_shards[shard]->inbox().tryPush(std::move(backlog.front())))
+                backlog.pop_front();
+        }
+    }
+public:
+    Lobby(NetServer &server, size_t shardCount, size_t roomCount, const std::string &checkpointFile, bool autoTuneTrees,
+        bool overloadControl)
+        : m_server(server)
+    {
+        if(shardCount == 0)
+            shardCount = 1;
+        if(roomCount == 0)
+            roomCount = 1;
+        for(size_t i = 0; i < shardCount; ++i)
+            m_shards.emplace_back(new RoomShard(static_cast<uint32_t>(i), *this, server));
+        m_backlog.resize(shardCount);
+        std::random_device seeds;
+        double now = timer();
+        for(uint32_t id = 0; id < roomCount; ++id)
+        {
+            RoomPtr room(new Room(id, seeds(), now, autoTuneTrees, overloadControl));
+            if(!checkpointFile.empty())
+                room->enableCheckpoints(checkpointFile + "." + std::to_string(id));
+            uint32_t shard = id % shardCount;
+            m_rooms.push_back(RoomInfo{shard, 0, false});
+            m_shards[shard]->adoptNow(std::move(room));
+        }
+    }
+    Lobby(const Lobby &) = delete;
+
+    void start(void)
+    {
+        for(auto &shard : m_shards)
+            shard->start();
+    }
+    void stop(void)
+    {
+        for(auto &shard : m_shards)
+            shard->stop();
+    }
+
+    // Shard side: a room it was handed is running there now
+    void roomAdopted(uint32_t roomId)
+    {
+        while(!m_adopted.tryPush(roomId))
+            std::this_thread::yield(); // Never more than one move per room in flight, so this drains quickly
+    }
+    // Shard side: where to send a room it released
+    RoomShard &shard(uint32_t index)
+    {return *m_shards[index];}
+
+    // Returns false if there was nothing to do
+    bool route(void)
+    {
+        PROFILE_ZONE(ProfileZoneId::input);
+        uint32_t roomId;
+        bool adopted = false;
+        while(m_adopted.tryPop(roomId))
+        {
+            m_rooms[roomId].migrating = false;
+            adopted = true;
+        }
+        _flushBacklog();
+        bool busy = false;
+        if(adopted && !m_waiting.empty())
+        {
+            std::deque<NetCommand> waiting;
+            waiting.swap(m_waiting);
+            for(const NetCommand &cmd : waiting) if(!_dispatch(cmd))
+                m_waiting.push_back(cmd);
+            busy = true;
+        }
+        NetCommand cmd;
+        while(m_server.inbound().tryPop(cmd))
+        {
+            busy = true;
+            if(!_dispatch(cmd))
+                m_waiting.push_back(cmd);
+        }
+        return busy;
+    }
+
+    // Moves at most one idle room, from the busiest shard to the quietest, when that evens them out
+    void rebalance(void)
+    {
+        uint32_t busiest = 0, quietest = 0;
+        for(uint32_t shard = 1; shard < m_shards.size(); ++shard)
+        {
+            if(_shardLoad(shard) > _shardLoad(busiest))
+                busiest = shard;
+            if(_shardLoad(shard) < _shardLoad(quietest))
+                quietest = shard;
+        }
+        if(_shardLoad(busiest) < _shardLoad(quietest) + 2)
+            return;
+        for(uint32_t id = 0; id < m_rooms.size(); ++id)
+        {
+            RoomInfo &info = m_rooms[id];
+            if(info.shard != busiest || info.migrating || info.players)
+                continue;
+            info.migrating = true;
+            info.shard = quietest;
+            ShardMessage msg;
+            msg.kind = ShardMessage::Kind::release;
+            msg.roomId = id;
+            msg.target = quietest;
+            _post(busiest, std::move(msg));
+            debugPrintln("Moving room %u from shard %u to shard %u", id, busiest, quietest);
+            return;
+        }
+    }
+
+    void publishGauges(void)
+    {
+        size_t players = 0, entities = 0, items = 0, treeNodes = 0, treeDepth = 0;
+        OverloadStats overload;
+        for(const RoomInfo &info : m_rooms)
+            players += info.players;
+        for(const auto &shard : m_shards)
+        {
+            shard->overload(overload);
+            entities += shard->entities();
+            items += shard->items();
+            treeNodes += shard->treeNodes();
+            if(shard->treeDepth() > treeDepth)
+                treeDepth = shard->treeDepth();
+        }
+        PROFILE_GAUGE(ProfileGaugeId::players, players);
+        PROFILE_GAUGE(ProfileGaugeId::entities, entities);
+        PROFILE_GAUGE(ProfileGaugeId::items, items);
+        PROFILE_GAUGE(ProfileGaugeId::treeNodes, treeNodes);
+        PROFILE_GAUGE(ProfileGaugeId::treeDepth, treeDepth);
+        PROFILE_GAUGE(ProfileGaugeId::bytesIn, m_server.bytesIn());
+        PROFILE_GAUGE(ProfileGaugeId::bytesOut, m_server.bytesOut());
+        PROFILE_GAUGE(ProfileGaugeId::snapshotsDropped, m_server.snapshotsDropped());
+        PROFILE_GAUGE(ProfileGaugeId::overloadLevel, overload.level);
+        PROFILE_GAUGE(ProfileGaugeId::overloadRaises, overload.raises);
+        PROFILE_GAUGE(ProfileGaugeId::overloadLowers, overload.lowers);
+        PROFILE_GAUGE(ProfileGaugeId::tickOverruns, overload.overruns);
+        PROFILE_GAUGE(ProfileGaugeId::snapshotsShed, overload.snapshotsShed);
+    }
+};
+
+inline void RoomShard::_receive(ShardMessage &msg)
+{
+    switch(msg.kind)
+    {
+    case ShardMessage::Kind::command: {
+        Room *room = _find(msg.roomId);
+        if(room)
+            room->handle(msg.cmd);
+        break;
+    }
+    case ShardMessage::Kind::adopt:
+        m_rooms.push_back(std::move(msg.room));
+        m_lobby.roomAdopted(msg.roomId);
+        break;
+    case ShardMessage::Kind::release:
+        for(size_t i = 0; i < m_rooms.size(); ++i) if(m_rooms[i]->id() == msg.roomId)
+        {
+            ShardMessage handoff;
+            handoff.kind = ShardMessage::Kind::adopt;
+            handoff.roomId = msg.roomId;
+            handoff.target = msg.target;
+            handoff.room = std::move(m_rooms[i]);
+            m_rooms.erase(m_rooms.begin() + i);
+            m_handoffs.push_back(std::move(handoff)); // Pushed to the target by _flushHandoffs
+            break;
+        }
+        break;
+    }
+}
+
+inline void RoomShard::_flushHandoffs(void)
+{
+    while(!m_handoffs.empty())
+    {
+        ShardMessage &handoff = m_handoffs.front();
+        if(!m_lobby.shard(handoff.target).inbox().tryPush(std::move(handoff)))
+            return;
+        m_handoffs.pop_front();
+    }
+}
+
+inline void RoomShard::_run(void)
+{
+    while(m_running.load(std::memory_order_acquire))
+    {
+        {
+            PROFILE_ZONE(ProfileZoneId::input);
+            ShardMessage msg;
+            while(m_inbox.tryPop(msg))
+                _receive(msg);
+            _flushHandoffs();
+        }
+
+        double now = timer(), next = now + tickInterval;
+        for(RoomPtr &room : m_rooms)
+        {
+            if(now >= room->nextTick())
+                room->tick(now, m_server);
+            if(room->nextTick() < next)
+                next = room->nextTick();
+        }
+        if(now - m_lastStats >= statsInterval)
+        {
+            _collectStats();
+            m_lastStats = now;
+        }
+
+        // Short naps even when the next tick is further off, so commands do not sit in the inbox for long
+        double wait = next - timer();
+        if(wait > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>((wait < 0.001) ? wait : 0.001));
+    }
+}
 
 void atexit1(void)
 {
     debugPrintln("Server ended");
 }
-int main(void)
+// Usage: Z4 [-u] [-l lossRate] [-s statsFile] [-S statsSocket] [-q | -v] [-c checkpointFile] [-W shards] [-R rooms] [-T] [-O]
+//   -u  also serve the UDP transport on the same port number
+//   -l  drop this fraction of outgoing UDP datagrams on purpose (testing only)
+//   -s  append profiler stats to this file once per second, one JSON object per line
+//   -S  send the same lines as datagrams to this Unix socket
+//   -q  only log warnings and errors; -v also logs debug messages
+//   -c  resume each room from checkpointFile.<room> if it exists, and write a new one every few seconds
+//   -W  simulation threads; one per core by default
+//   -R  rooms hosted by this process; one per simulation thread by default
+//   -T  let every room adjust its tree node capacities to the load
+//   -O  never degrade a room that falls behind; the overload counters are still kept
+int main(int argc, char **argv)
 {
     startTime = timer();
+    Logger::instance().setEpoch(startTime); // Constructed before atexit1 is registered, so it outlives it
     atexit(atexit1);
-    double pastTime = startTime;
-    double currentTime = startTime;
     bool gameRunning = true;
     debugPrintln("Server started");
     Matrix2x2 rmatrix = rotateMatrix(3.1415926535897932 / 4.0); // Example rotation matrix for 45 degrees
@@ -424,17 +1361,73 @@ int main(void)
     PointVector vec1 = rmatrix * vec; // Rotate the vector using the rotation matrix
     
     debugPrintln("Rotated vector: (%lf, %lf)", vec1[0], vec1[1]);
+    NetServer server(serverPort, netThreadCount);
+    UdpThread::Config udpConfig;
+    udpConfig.port = serverPort;
+    bool useUdp = false, autoTuneTrees = false, overloadControl = true;
+    std::string statsFile, statsSocket, checkpointFile;
+    size_t shardCount = std::thread::hardware_concurrency(), roomCount = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-u"))
+            useUdp = true;
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+            udpConfig.lossRate = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-s") && i + 1 < argc)
+            statsFile = argv[++i];
+        else if(!strcmp(argv[i], "-S") && i + 1 < argc)
+            statsSocket = argv[++i];
+        else if(!strcmp(argv[i], "-q"))
+            Logger::instance().setLevel(LogLevel::warn);
+        else if(!strcmp(argv[i], "-v"))
+            Logger::instance().setLevel(LogLevel::debug);
+        else if(!strcmp(argv[i], "-c") && i + 1 < argc)
+            checkpointFile = argv[++i];
+        else if(!strcmp(argv[i], "-W") && i + 1 < argc)
+            shardCount = static_cast<size_t>(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "-R") && i + 1 < argc)
+            roomCount = static_cast<size_t>(atoi(argv[++i]));
+        else if(!strcmp(argv[i], "-T"))
+            autoTuneTrees = true;
+        else if(!strcmp(argv[i], "-O"))
+            overloadControl = false;
+    }
+    if(shardCount == 0)
+        shardCount = 1;
+    if(roomCount == 0)
+        roomCount = shardCount;
+    if(useUdp)
+        server.enableUdp(udpConfig);
+    std::unique_ptr<StatsExporter> stats;
+    if(!statsFile.empty() || !statsSocket.empty())
+    {
+        stats.reset(new StatsExporter(statsFile, statsSocket));
+        stats->start();
+    }
+    if(!server.start())
+    {
+        debugErrPrintln("Error: Could not listen on port %u.", serverPort);
+        return 1;
+    }
+    Lobby lobby(server, shardCount, roomCount, checkpointFile, autoTuneTrees, overloadControl);
+    lobby.start();
+    debugPrintln("%u rooms on %u simulation threads", roomCount, shardCount);
+    double lastMaintenance = timer();
     do
     {
-        double currentTime = timer();
-        if(currentTime - pastTime < 0)
+        if(!lobby.route())
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        double now = timer();
+        if(now - lastMaintenance >= rebalanceInterval)
         {
-            debugErrPrintln("Error: Current time is less than past time. This should not happen.");
-            break;
+            lobby.rebalance();
+            lobby.publishGauges();
+            lastMaintenance = now;
         }
-        pastTime = currentTime;
-
-
     }while(gameRunning);
+    lobby.stop();
+    if(stats)
+        stats->stop();
+    server.stop();
     
 }
\ No newline at end of file
@@ -31,9 +31,9 @@ namespace _qt
     }
 
     template<typename T>
-    void _Node<T>::divideNode(void)
+    void _Node<T>::divideNode(size_t countLimit, size_t maxDepth)
     {
-        if(isLeaf())
+        if(isLeaf() && m_depth < maxDepth && divisible())
         {
             PointVector center = m_boundingBox.center();
             for(size_t i = 0; i < 4; ++i)
@@ -47,14 +47,21 @@ namespace _qt
         while(!m_data.empty())
         {
             auto bg = m_data.begin();
+            _Node<T> *dest = m_children[0]; // Only if it moved out of this node; the next query puts it right
             for(_Node<T> *child : children()) if(child->contains(bg->pos))
             {
-                child->m_data.splice(child->m_data.end(), m_data, bg);
+                dest = child;
                 break;
             }
+            dest->m_data.splice(dest->m_data.end(), m_data, bg);
         }
         m_isLeaf = false; // Mark this as an internal node now
-        m_data.clear();
+        for(_Node<T> *child : children())
+        {
+            child->m_count = child->m_data.size();
+            if(child->m_count > countLimit) // All of them may have landed in one quadrant
+                child->divideNode(countLimit, maxDepth);
+        }
     }
 
     template<typename T>
@@ -65,7 +72,7 @@ namespace _qt
     }
 
     template<typename T>
-    void _applyDelete(_Node<T> *node, size_t countLimit, size_t _deleted = 1)
+    void _applyDelete(_Node<T> *node, size_t _deleted = 1)
     {
         while((node = node->m_parent)) // Moving up to the parent first because we already took decrement of count when we checked the parent
             node->m_count -= _deleted;
@@ -91,17 +98,19 @@ namespace _qt
         return node;
     }
 
+    // Moves *itr, now held in from, out of the leaf it was counted in (node) and into the leaf that
+    // contains its pos: up to the first ancestor containing it, then down again
     template<typename T>
-    void _reinsertNode(_Node<T> *node, typename std::list<_QTData<T>>::iterator itr, size_t countLimit)
+    void _reinsertNode(_Node<T> *node, std::list<_QTData<T>> &from, typename std::list<_QTData<T>>::iterator itr,
+        size_t countLimit, size_t maxDepth)
     {
-        _Node<T> *existing = node;
         PointVector pos = itr->pos;
-        size_t i = 0;
         --(node->m_count);
         for(node = node->parent(); node; node = node->parent())
         {
             if(node->contains(pos))
             {
+                _Node<T> *top = node;
                 while(!node->isLeaf())
                 {
                     bool found = false;
@@ -114,32 +123,40 @@ namespace _qt
                     }
                     if(!found)
                     {
-                        existing->m_data.erase(itr);
+                        for(;; node = node->parent()) // Undo the way down; above top was done on the way up
+                        {
+                            --(node->m_count);
+                            if(node == top)
+                                break;
+                        }
+                        from.erase(itr);
                         return;
                     }
                 }
-                node->m_data.splice(node->m_data.end(), existing->m_data, itr);
+                node->m_data.splice(node->m_data.end(), from, itr);
                 if(node->m_count > countLimit)
-                    node->divideNode();
+                    node->divideNode(countLimit, maxDepth);
                 return;
             }
             --(node->m_count);
         }
-        existing->m_data.erase(itr);
+        from.erase(itr); // Left the tree's bounding box
     }
 
+    // Folds subtrees at half the split limit or below, so elements crossing a boundary do not
+    // split and merge the same node on every query
     template<typename T>
     struct _MergeByRect
     {
         size_t countLimit;
-        const Rect &rect;
+        Bounds rect;
         void operator()(_Node<T> *node)
         {
             if(!node || node->isLeaf() || !node->intersects(rect))
                 return;
             for(_Node<T> *child : node->children())
                 (*this)(child);
-            if(node->m_count <= countLimit)
+            if(node->m_count <= countLimit / 2)
             {
                 for(_Node<T> *&child : node->m_children)
                 {
@@ -154,9 +171,12 @@ namespace _qt
     template<typename T, typename LeafQuery>
     struct _QueryLeafByRect
     {
+        typedef typename std::list<_QTData<T>>::iterator Iterator;
         LeafQuery lq;
         size_t countLimit;
-        const Rect &rect;
+        Bounds rect;
+        std::list<_QTData<T>> moved; // Left their leaf; put back by finish()
+        std::vector<std::pair<_Node<T> *, Iterator>> movedFrom;
         void _leaf(_Node<T> *node)
         {
             if(!node->intersects(rect))
@@ -165,7 +185,7 @@ namespace _qt
             lq(node->m_data);
             size_t after = (node->m_count = node->m_data.size());
             if(after < before)
-                _applyDelete(node, countLimit, before - after);
+                _applyDelete(node, before - after);
             else if(after > before)
                 _applyInsert(node, after - before);
             auto i = node->m_data.begin();
@@ -174,9 +194,19 @@ namespace _qt
                 auto tail = i;
                 ++i;
                 if(!node->contains(tail->pos))
-                    _reinsertNode(node, tail, countLimit);
+                {
+                    moved.splice(moved.end(), node->m_data, tail); // Still counted in node until finish()
+                    movedFrom.emplace_back(node, tail);
+                }
             }
         }
+        // No node has been deleted yet, and a leaf that has been divided since still counts the element
+        void finish(size_t maxDepth)
+        {
+            for(auto &entry : movedFrom)
+                _reinsertNode(entry.first, moved, entry.second, countLimit, maxDepth);
+            movedFrom.clear();
+        }
         void operator()(_Node<T> *node)
         {
             if(!node || !node->intersects(rect))
@@ -190,11 +220,12 @@ namespace _qt
 }
 template<typename T>
 template<typename LeafQuery>
-void QuadTree<T>::queryRect(const Rect &searchArea, LeafQuery &&func)
+void EntityTree<T>::queryRect(const Bounds &searchArea, LeafQuery &&func)
 {
     {
-        _qt::_QueryLeafByRect<T, std::add_rvalue_reference_t<LeafQuery> > _temp = {std::forward<LeafQuery>(func), m_countLimit, searchArea};
+        _qt::_QueryLeafByRect<T, std::add_rvalue_reference_t<LeafQuery> > _temp = {std::forward<LeafQuery>(func), m_countLimit, searchArea, {}, {}};
         _temp(&m_root);
+        _temp.finish(m_maxDepth);
     }
     {
         _qt::_MergeByRect<T> _temp = {m_countLimit, searchArea};
@@ -203,13 +234,16 @@ void QuadTree<T>::queryRect(const Rect &searchArea, LeafQuery &&func)
 }
 
 template<typename T>
-void QuadTree<T>::insert(const PointVector &pos, const T &data)
+bool EntityTree<T>::insert(const PointVector &pos, const T &data)
 {
-    NodeType *node = _queryLeafByPoint(&m_root, pos);
-    node->m_data.push_back(LocatedData{pos, data}); // Insert data into the leaf node
-    if(++(node->m_count) > m_countLimit)
-        node->divideNode();
+    NodeType *node = _qt::_queryLeafByPoint(&m_root, pos);
+    if(!node)
+        return false;
+    node->m_data.push_back(ValueType{pos, data}); // Insert data into the leaf node
     _qt::_applyInsert(node); // Apply insert logic
+    if(++(node->m_count) > m_countLimit)
+        node->divideNode(m_countLimit, m_maxDepth);
+    return true;
 }
 
 